@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_card_registry"
+//#define LOG_NDEBUG 0
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <log/log.h>
+
+#include "card_registry.h"
+
+void card_registry_init(struct card_registry *reg)
+{
+    memset(reg, 0, sizeof(*reg));
+    pthread_mutex_init(&reg->lock, NULL);
+
+    reg->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reg->inotify_fd >= 0 &&
+            inotify_add_watch(reg->inotify_fd, "/dev/snd", IN_CREATE | IN_DELETE) < 0) {
+        ALOGW("%s : can't watch /dev/snd, cards will be probed on every lookup", __func__);
+        close(reg->inotify_fd);
+        reg->inotify_fd = -1;
+    }
+}
+
+void card_registry_release(struct card_registry *reg)
+{
+    if (reg->inotify_fd >= 0)
+        close(reg->inotify_fd);
+    reg->inotify_fd = -1;
+    reg->count = 0;
+    pthread_mutex_destroy(&reg->lock);
+}
+
+/* must be called with the registry mutex locked */
+static void registry_sync_l(struct card_registry *reg)
+{
+    char events[sizeof(struct inotify_event) + NAME_MAX + 1]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = reg->inotify_fd < 0;
+
+    if (reg->inotify_fd >= 0) {
+        while (read(reg->inotify_fd, events, sizeof(events)) > 0)
+            changed = true;
+    }
+
+    if (changed) {
+        reg->count = 0;
+        reg->generation++;
+    }
+}
+
+static int read_card_link(const char *name)
+{
+    char id_filepath[PATH_MAX] = {0};
+    char number_filepath[PATH_MAX] = {0};
+    ssize_t written;
+
+    snprintf(id_filepath, sizeof(id_filepath), "/proc/asound/%s", name);
+
+    written = readlink(id_filepath, number_filepath, sizeof(number_filepath));
+    if (written < 0) {
+        ALOGE("Sound card %s does not exist", name);
+        return -1;
+    } else if (written >= (ssize_t)sizeof(number_filepath)) {
+        ALOGE("Sound card %s name is too long", name);
+        return -1;
+    }
+    ALOGI("Sound card %s exists", name);
+    /* the link reads "cardN", 4 == strlen("card") */
+    return atoi(number_filepath + 4);
+}
+
+uint32_t card_registry_sync(struct card_registry *reg)
+{
+    uint32_t generation;
+
+    pthread_mutex_lock(&reg->lock);
+    registry_sync_l(reg);
+    generation = reg->generation;
+    pthread_mutex_unlock(&reg->lock);
+
+    return generation;
+}
+
+int card_registry_find(struct card_registry *reg, const char *name)
+{
+    unsigned int i;
+    int card;
+
+    pthread_mutex_lock(&reg->lock);
+    registry_sync_l(reg);
+
+    for (i = 0; i < reg->count; i++) {
+        if (strcmp(reg->cards[i].name, name) == 0) {
+            card = reg->cards[i].card;
+            pthread_mutex_unlock(&reg->lock);
+            return card;
+        }
+    }
+
+    card = read_card_link(name);
+    /* a full table or an overlong id only means the next lookup reads the link again */
+    if (reg->count < CARD_REGISTRY_SIZE && strlen(name) < CARD_REGISTRY_NAME_MAX) {
+        strcpy(reg->cards[reg->count].name, name);
+        reg->cards[reg->count].card = card;
+        reg->count++;
+    }
+    pthread_mutex_unlock(&reg->lock);
+
+    return card;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_CARD_REGISTRY_H
+#define AUDIO_CARD_REGISTRY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define CARD_REGISTRY_SIZE      8
+#define CARD_REGISTRY_NAME_MAX  32
+
+/*
+ * Card index by ALSA card id (the /proc/asound/<id> link), looked up once
+ * and kept until a sound card node is created or removed under /dev/snd.
+ * /proc/asound itself is procfs and reports no inotify events. Without the
+ * watch every lookup reads the link again.
+ *
+ * The registry has its own lock, lookups may come from any thread.
+ */
+struct card_registry {
+    pthread_mutex_t lock;
+    int inotify_fd;
+    uint32_t generation; /* bumped each time the cached lookups are dropped */
+    unsigned int count;
+    struct {
+        char name[CARD_REGISTRY_NAME_MAX];
+        int card; /* -1 when the card was not there */
+    } cards[CARD_REGISTRY_SIZE];
+};
+
+void card_registry_init(struct card_registry *reg);
+void card_registry_release(struct card_registry *reg);
+
+/*
+ * Drops the cached lookups if a card came or went since the last call.
+ * Returns the generation, callers caching what they derived from the cards
+ * (pcm_params, mixers) refresh it when the generation moves.
+ */
+uint32_t card_registry_sync(struct card_registry *reg);
+
+/* Card index of the card with id |name|, -1 when there is none. */
+int card_registry_find(struct card_registry *reg, const char *name);
+
+#endif /* AUDIO_CARD_REGISTRY_H */
@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_pcm_dump"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <log/log.h>
+
+#include "pcm_dump.h"
+
+#define PCM_DUMP_RING_SIZE      (256 * 1024) /* ~1.3 s of 48 kHz stereo */
+#define PCM_DUMP_DRAIN_MS       20
+#define PCM_DUMP_WRITER_NICE    10
+#define PCM_DUMP_WAV_HEADER     44
+
+/* precedes every buffer in a tap ring */
+struct pcm_dump_record {
+    uint32_t format;            /* rate << 8 | channels */
+    uint32_t bytes;
+};
+
+struct pcm_dump {
+    pthread_mutex_t lock; /* tap registration, selection and writer wakeups */
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool exit;
+
+    char dir[PATH_MAX];
+    char prefix[PCM_DUMP_NAME_MAX];
+    char selection[PCM_DUMP_MAX_TAPS * PCM_DUMP_NAME_MAX];
+
+    atomic_uint tap_count;
+    struct pcm_dump_tap taps[PCM_DUMP_MAX_TAPS];
+
+    /* writer thread only */
+    FILE *files[PCM_DUMP_MAX_TAPS];
+    uint32_t file_bytes[PCM_DUMP_MAX_TAPS];
+    unsigned int file_format[PCM_DUMP_MAX_TAPS]; /* of the open file */
+    unsigned int file_count[PCM_DUMP_MAX_TAPS];
+};
+
+static void pcm_dump_ring_put(struct pcm_dump_tap *tap, size_t pos, const void *buf, size_t bytes)
+{
+    size_t offset = pos & (tap->size - 1);
+    size_t first = tap->size - offset < bytes ? tap->size - offset : bytes;
+
+    memcpy(tap->data + offset, buf, first);
+    memcpy(tap->data, (const uint8_t *)buf + first, bytes - first);
+}
+
+static void pcm_dump_ring_get(struct pcm_dump_tap *tap, size_t pos, void *buf, size_t bytes)
+{
+    size_t offset = pos & (tap->size - 1);
+    size_t first = tap->size - offset < bytes ? tap->size - offset : bytes;
+
+    memcpy(buf, tap->data + offset, first);
+    memcpy((uint8_t *)buf + first, tap->data, bytes - first);
+}
+
+void pcm_dump_push(struct pcm_dump_tap *tap, const void *buf, size_t bytes,
+                   unsigned int rate, unsigned int channels)
+{
+    struct pcm_dump_record record = {
+        .format = rate << 8 | channels,
+        .bytes = bytes,
+    };
+    size_t head, tail;
+
+    /* pairs with the release in pcm_dump_enable(), data is set up */
+    if (!atomic_load_explicit(&tap->enabled, memory_order_acquire))
+        return;
+
+    head = atomic_load_explicit(&tap->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&tap->tail, memory_order_acquire);
+    if (tap->size - (head - tail) < sizeof(record) + bytes) {
+        atomic_fetch_add_explicit(&tap->dropped, bytes, memory_order_relaxed);
+        return;
+    }
+
+    pcm_dump_ring_put(tap, head, &record, sizeof(record));
+    pcm_dump_ring_put(tap, head + sizeof(record), buf, bytes);
+
+    atomic_store_explicit(&tap->head, head + sizeof(record) + bytes, memory_order_release);
+}
+
+static bool pcm_dump_selected(const char *selection, const char *name)
+{
+    const char *p = selection;
+    size_t len = strlen(name);
+
+    if (strcmp(selection, "all") == 0)
+        return true;
+
+    while (*p != '\0') {
+        const char *end = strchr(p, ',');
+        size_t n = end != NULL ? (size_t)(end - p) : strlen(p);
+
+        /* the name itself or a tap of that family, out_write selects out_write_13 */
+        if (n <= len && strncmp(p, name, n) == 0 && (n == len || name[n] == '_'))
+            return true;
+        if (end == NULL)
+            break;
+        p = end + 1;
+    }
+    return false;
+}
+
+/* must be called with dump mutex locked */
+static void pcm_dump_enable(struct pcm_dump_tap *tap, bool enable)
+{
+    if (enable && tap->data == NULL) {
+        tap->data = (uint8_t *)malloc(tap->size);
+        if (tap->data == NULL) {
+            ALOGE("%s : no memory for tap %s", __func__, tap->name);
+            return;
+        }
+    }
+    atomic_store_explicit(&tap->enabled, enable, memory_order_release);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void pcm_dump_wav_header(uint8_t *h, unsigned int format, uint32_t data_bytes)
+{
+    unsigned int rate = format >> 8;
+    unsigned int channels = format & 0xff;
+
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, 36 + data_bytes);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 16);
+    put_le16(h + 20, 1); /* PCM */
+    put_le16(h + 22, channels);
+    put_le32(h + 24, rate);
+    put_le32(h + 28, rate * channels * 2);
+    put_le16(h + 32, channels * 2);
+    put_le16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, data_bytes);
+}
+
+static void pcm_dump_open_file(struct pcm_dump *dump, unsigned int i, unsigned int format)
+{
+    struct pcm_dump_tap *tap = &dump->taps[i];
+    uint8_t header[PCM_DUMP_WAV_HEADER];
+    char path[PATH_MAX];
+    char stamp[32];
+    struct tm tm;
+    time_t now = time(NULL);
+
+    /* a format change can start the next file within the same second */
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+    snprintf(path, sizeof(path), "%s/%s_%s_%s_%u.wav", dump->dir, dump->prefix, tap->name,
+            stamp, dump->file_count[i]++);
+
+    dump->files[i] = fopen(path, "w");
+    dump->file_bytes[i] = 0;
+    dump->file_format[i] = format;
+    if (dump->files[i] == NULL) {
+        ALOGE("%s : cannot create %s: %s", __func__, path, strerror(errno));
+        return;
+    }
+
+    /* sizes are filled in when the file is closed */
+    pcm_dump_wav_header(header, format, 0);
+    fwrite(header, 1, sizeof(header), dump->files[i]);
+    ALOGI("%s : dumping %s to %s, %u Hz, %u channels", __func__, tap->name, path,
+            format >> 8, format & 0xff);
+}
+
+static void pcm_dump_close_file(struct pcm_dump *dump, unsigned int i)
+{
+    struct pcm_dump_tap *tap = &dump->taps[i];
+    uint8_t header[PCM_DUMP_WAV_HEADER];
+
+    pcm_dump_wav_header(header, dump->file_format[i], dump->file_bytes[i]);
+    fseek(dump->files[i], 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), dump->files[i]);
+    fclose(dump->files[i]);
+    dump->files[i] = NULL;
+
+    ALOGI("%s : %s done, %" PRIu32 " bytes, %" PRIu64 " dropped", __func__, tap->name,
+            dump->file_bytes[i],
+            (uint64_t)atomic_exchange_explicit(&tap->dropped, 0, memory_order_relaxed));
+}
+
+/*
+ * writer thread only. Moves what the tap pushed to its file, starting a new
+ * one when the format changed since the header of the open one was written.
+ */
+static void pcm_dump_drain(struct pcm_dump *dump, unsigned int i, bool closing)
+{
+    struct pcm_dump_tap *tap = &dump->taps[i];
+    bool enabled = !closing && atomic_load_explicit(&tap->enabled, memory_order_acquire);
+    size_t head = atomic_load_explicit(&tap->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&tap->tail, memory_order_relaxed);
+
+    while (head != tail) {
+        struct pcm_dump_record record;
+        size_t offset, first;
+
+        pcm_dump_ring_get(tap, tail, &record, sizeof(record));
+        tail += sizeof(record);
+        offset = tail & (tap->size - 1);
+        first = tap->size - offset < record.bytes ? tap->size - offset : record.bytes;
+
+        if (dump->files[i] != NULL && dump->file_format[i] != record.format)
+            pcm_dump_close_file(dump, i);
+        if (dump->files[i] == NULL)
+            pcm_dump_open_file(dump, i, record.format);
+        if (dump->files[i] != NULL) {
+            fwrite(tap->data + offset, 1, first, dump->files[i]);
+            fwrite(tap->data, 1, record.bytes - first, dump->files[i]);
+            dump->file_bytes[i] += record.bytes;
+        }
+        tail += record.bytes;
+        atomic_store_explicit(&tap->tail, tail, memory_order_release);
+    }
+
+    if (!enabled && dump->files[i] != NULL)
+        pcm_dump_close_file(dump, i);
+}
+
+static void *pcm_dump_writer(void *context)
+{
+    struct pcm_dump *dump = (struct pcm_dump *)context;
+    unsigned int i, count;
+
+    /* stay out of the way of the audio threads */
+    setpriority(PRIO_PROCESS, gettid(), PCM_DUMP_WRITER_NICE);
+
+    pthread_mutex_lock(&dump->lock);
+    while (!dump->exit) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PCM_DUMP_DRAIN_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&dump->cond, &dump->lock, &ts);
+
+        count = atomic_load_explicit(&dump->tap_count, memory_order_acquire);
+        pthread_mutex_unlock(&dump->lock);
+        for (i = 0; i < count; i++)
+            pcm_dump_drain(dump, i, false);
+        pthread_mutex_lock(&dump->lock);
+
+        /* taps put back and written out are free for the next name */
+        for (i = 0; i < count; i++) {
+            struct pcm_dump_tap *tap = &dump->taps[i];
+
+            if (tap->released && dump->files[i] == NULL &&
+                    atomic_load_explicit(&tap->head, memory_order_relaxed) ==
+                    atomic_load_explicit(&tap->tail, memory_order_relaxed)) {
+                tap->released = false;
+                tap->name[0] = '\0';
+            }
+        }
+    }
+    pthread_mutex_unlock(&dump->lock);
+
+    count = atomic_load_explicit(&dump->tap_count, memory_order_acquire);
+    for (i = 0; i < count; i++)
+        pcm_dump_drain(dump, i, true);
+
+    return NULL;
+}
+
+struct pcm_dump *pcm_dump_create(const char *dir, const char *prefix)
+{
+    struct pcm_dump *dump = (struct pcm_dump *)calloc(1, sizeof(struct pcm_dump));
+
+    if (dump == NULL)
+        return NULL;
+
+    strlcpy(dump->dir, dir, sizeof(dump->dir));
+    strlcpy(dump->prefix, prefix, sizeof(dump->prefix));
+    atomic_init(&dump->tap_count, 0);
+    pthread_mutex_init(&dump->lock, NULL);
+    pthread_cond_init(&dump->cond, NULL);
+
+    if (pthread_create(&dump->thread, NULL, pcm_dump_writer, dump) != 0) {
+        ALOGE("%s : cannot start the writer thread", __func__);
+        pthread_cond_destroy(&dump->cond);
+        pthread_mutex_destroy(&dump->lock);
+        free(dump);
+        return NULL;
+    }
+
+    return dump;
+}
+
+void pcm_dump_destroy(struct pcm_dump *dump)
+{
+    unsigned int i;
+
+    if (dump == NULL)
+        return;
+
+    pthread_mutex_lock(&dump->lock);
+    dump->exit = true;
+    pthread_cond_signal(&dump->cond);
+    pthread_mutex_unlock(&dump->lock);
+    pthread_join(dump->thread, NULL);
+
+    for (i = 0; i < PCM_DUMP_MAX_TAPS; i++)
+        free(dump->taps[i].data);
+    pthread_cond_destroy(&dump->cond);
+    pthread_mutex_destroy(&dump->lock);
+    free(dump);
+}
+
+struct pcm_dump_tap *pcm_dump_tap_get(struct pcm_dump *dump, const char *name)
+{
+    struct pcm_dump_tap *tap = NULL;
+    unsigned int i, count;
+
+    if (dump == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&dump->lock);
+    count = atomic_load_explicit(&dump->tap_count, memory_order_relaxed);
+    for (i = 0; i < count; i++) {
+        if (!dump->taps[i].released && strcmp(dump->taps[i].name, name) == 0) {
+            tap = &dump->taps[i];
+            goto exit;
+        }
+    }
+
+    /* a slot given back earlier, its ring positions carry on */
+    for (i = 0; i < count; i++) {
+        if (!dump->taps[i].released && dump->taps[i].name[0] == '\0') {
+            tap = &dump->taps[i];
+            strlcpy(tap->name, name, sizeof(tap->name));
+            atomic_store_explicit(&tap->dropped, 0, memory_order_relaxed);
+            if (pcm_dump_selected(dump->selection, name))
+                pcm_dump_enable(tap, true);
+            goto exit;
+        }
+    }
+
+    if (count == PCM_DUMP_MAX_TAPS) {
+        ALOGE("%s : no room for tap %s", __func__, name);
+        goto exit;
+    }
+
+    tap = &dump->taps[count];
+    strlcpy(tap->name, name, sizeof(tap->name));
+    tap->size = PCM_DUMP_RING_SIZE;
+    atomic_init(&tap->head, 0);
+    atomic_init(&tap->tail, 0);
+    atomic_init(&tap->dropped, 0);
+    atomic_init(&tap->enabled, false);
+    tap->released = false;
+    if (pcm_dump_selected(dump->selection, name))
+        pcm_dump_enable(tap, true);
+    atomic_store_explicit(&dump->tap_count, count + 1, memory_order_release);
+
+exit:
+    pthread_mutex_unlock(&dump->lock);
+    return tap;
+}
+
+void pcm_dump_tap_put(struct pcm_dump *dump, struct pcm_dump_tap *tap)
+{
+    if (dump == NULL || tap == NULL)
+        return;
+
+    pthread_mutex_lock(&dump->lock);
+    pcm_dump_enable(tap, false);
+    tap->released = true;
+    /* let the writer finish the file and free the slot */
+    pthread_cond_signal(&dump->cond);
+    pthread_mutex_unlock(&dump->lock);
+}
+
+int pcm_dump_set_taps(struct pcm_dump *dump, const char *value)
+{
+    unsigned int i, count;
+
+    if (dump == NULL)
+        return -ENOSYS;
+
+    pthread_mutex_lock(&dump->lock);
+    if (strcmp(value, "none") == 0)
+        dump->selection[0] = '\0';
+    else
+        strlcpy(dump->selection, value, sizeof(dump->selection));
+
+    count = atomic_load_explicit(&dump->tap_count, memory_order_relaxed);
+    for (i = 0; i < count; i++) {
+        struct pcm_dump_tap *tap = &dump->taps[i];
+
+        if (!tap->released && tap->name[0] != '\0')
+            pcm_dump_enable(tap, pcm_dump_selected(dump->selection, tap->name));
+    }
+
+    ALOGI("%s : taps \"%s\"", __func__, dump->selection);
+
+    /* let the writer open or finish files now */
+    pthread_cond_signal(&dump->cond);
+    pthread_mutex_unlock(&dump->lock);
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_PCM_DUMP_H
+#define AUDIO_PCM_DUMP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Runtime PCM taps for the HALs. Each tap point copies its buffer into a
+ * single producer / single consumer ring and returns; a low priority writer
+ * thread drains the rings into WAV files named after the tap and the time the
+ * capture started. A disabled tap costs one relaxed atomic load. A tap has
+ * one producer: buffers written from several threads need a tap each, e.g.
+ * one per stream, put back with pcm_dump_tap_put() when the stream goes.
+ * A new file is started whenever the rate or channel count changes.
+ *
+ * Taps are switched with set_parameters:
+ *   pcm_dump=out_write,in_read_12  dump these taps, stop all others; a name
+ *                                  also selects the taps called name_<suffix>
+ *   pcm_dump=all                   dump every tap
+ *   pcm_dump=none                  stop dumping
+ * The dump directory must exist and be writable by the audio server.
+ */
+
+#define PCM_DUMP_PARAMETER      "pcm_dump"
+#define PCM_DUMP_DIR_DEFAULT    "/vendor/dump"
+#define PCM_DUMP_MAX_TAPS       16
+#define PCM_DUMP_NAME_MAX       48
+
+struct pcm_dump;
+
+struct pcm_dump_tap {
+    atomic_bool enabled;
+    char name[PCM_DUMP_NAME_MAX];
+
+    /* ring, written by the tap point and read by the writer thread */
+    uint8_t *data;
+    size_t size;                /* power of two */
+    atomic_size_t head;         /* bytes pushed */
+    atomic_size_t tail;         /* bytes drained */
+    atomic_uint_least64_t dropped; /* bytes lost to a full ring */
+    bool released;              /* put back, the writer frees the slot once drained */
+};
+
+/* Starts the writer thread. Files go to dir, prefixed with prefix. */
+struct pcm_dump *pcm_dump_create(const char *dir, const char *prefix);
+
+/* Stops the writer thread, finishes open files and frees every tap. */
+void pcm_dump_destroy(struct pcm_dump *dump);
+
+/*
+ * Returns the tap called name, registering it on first use. Not for the audio
+ * thread: call it when the stream or loop is set up. NULL when dump is NULL or
+ * all taps are taken, which pcm_dump_write() accepts.
+ */
+struct pcm_dump_tap *pcm_dump_tap_get(struct pcm_dump *dump, const char *name);
+
+/*
+ * Gives the tap back once its producer is done with it. What it pushed is
+ * still written out, then the slot can be taken by another name. NULL is
+ * accepted.
+ */
+void pcm_dump_tap_put(struct pcm_dump *dump, struct pcm_dump_tap *tap);
+
+/* Applies a PCM_DUMP_PARAMETER value. Returns 0 or a negative errno. */
+int pcm_dump_set_taps(struct pcm_dump *dump, const char *value);
+
+void pcm_dump_push(struct pcm_dump_tap *tap, const void *buf, size_t bytes,
+                   unsigned int rate, unsigned int channels);
+
+/* 16 bit interleaved PCM. Never blocks, drops what doesn't fit. */
+static inline void pcm_dump_write(struct pcm_dump_tap *tap, const void *buf, size_t bytes,
+                                  unsigned int rate, unsigned int channels)
+{
+    if (tap != NULL && atomic_load_explicit(&tap->enabled, memory_order_relaxed))
+        pcm_dump_push(tap, buf, bytes, rate, channels);
+}
+
+#endif /* AUDIO_PCM_DUMP_H */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "stream_pacer.h"
+
+static int64_t pacer_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t pacer_frames_to_ns(uint64_t frames, uint32_t rate)
+{
+    return (int64_t)(frames / rate) * 1000000000LL +
+            (int64_t)(frames % rate) * 1000000000LL / rate;
+}
+
+void stream_pacer_reset(struct stream_pacer *pacer)
+{
+    pacer->base_ns = 0;
+    pacer->frames = 0;
+}
+
+int64_t stream_pacer_advance(struct stream_pacer *pacer, size_t frames, uint32_t rate)
+{
+    int64_t now = pacer_now_ns();
+
+    if (pacer->base_ns == 0 || pacer->rate != rate ||
+            now > pacer->base_ns + pacer_frames_to_ns(pacer->frames + frames, rate)) {
+        pacer->base_ns = now;
+        pacer->frames = 0;
+        pacer->rate = rate;
+    }
+    pacer->frames += frames;
+
+    return pacer->base_ns + pacer_frames_to_ns(pacer->frames, rate);
+}
+
+uint64_t stream_pacer_pending(const struct stream_pacer *pacer, int64_t now_ns)
+{
+    int64_t due;
+
+    if (pacer->base_ns == 0)
+        return 0;
+    due = pacer->base_ns + pacer_frames_to_ns(pacer->frames, pacer->rate);
+    if (due <= now_ns)
+        return 0;
+    return (uint64_t)(due - now_ns) * pacer->rate / 1000000000LL;
+}
+
+void stream_pacer_sleep_until(int64_t deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
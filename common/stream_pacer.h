@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_STREAM_PACER_H
+#define AUDIO_STREAM_PACER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Virtual device timeline for a stream whose pcm can't take or give data
+ * (device missing, call in progress): buffers are laid back to back from
+ * base_ns and each read or write returns when its last frame is due.
+ *
+ * A pacer has no lock of its own. Update it under the stream lock and sleep
+ * on the returned deadline after dropping it.
+ */
+struct stream_pacer {
+    int64_t base_ns; /* 0 while the device is running */
+    uint64_t frames;
+    uint32_t rate;
+};
+
+/* The device runs again, the next stream_pacer_advance() starts a new timeline. */
+void stream_pacer_reset(struct stream_pacer *pacer);
+
+/*
+ * Lays frames on the timeline and returns the CLOCK_MONOTONIC time the last
+ * of them is due. The timeline restarts when it was idle or fell behind by
+ * more than this buffer, so time spent in the failed call is absorbed
+ * instead of added.
+ */
+int64_t stream_pacer_advance(struct stream_pacer *pacer, size_t frames, uint32_t rate);
+
+/* frames laid on the timeline that are not due yet at CLOCK_MONOTONIC now_ns */
+uint64_t stream_pacer_pending(const struct stream_pacer *pacer, int64_t now_ns);
+
+/* sleeps until the CLOCK_MONOTONIC deadline returned by stream_pacer_advance() */
+void stream_pacer_sleep_until(int64_t deadline_ns);
+
+#endif /* AUDIO_STREAM_PACER_H */
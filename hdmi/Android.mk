@@ -30,9 +30,12 @@ LOCAL_C_INCLUDES += hardware/libhardware/include \
 			system/media/audio/include \
 
 LOCAL_SRC_FILES := \
-    tinyaudio_hw.c
+    tinyaudio_hw.c \
+    ../common/stream_pacer.c \
+    ../common/card_registry.c
 
 LOCAL_C_INCLUDES += \
+    $(LOCAL_PATH)/../common \
     external/tinyalsa/include
 
 LOCAL_CFLAGS :=\
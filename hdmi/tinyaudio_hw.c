@@ -55,6 +55,7 @@
 #include <sys/time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
@@ -67,6 +68,9 @@
 #include <sound/asound.h>
 #include <tinyalsa/asoundlib.h>
 
+#include "stream_pacer.h"
+#include "card_registry.h"
+
 #define UNUSED_PARAMETER(x)        (void)(x)
 
 #define DEFAULT_CARD               0
@@ -114,7 +118,6 @@ struct pcm_config pcm_config_default = {
     .period_count = 4,
     .format = PCM_FORMAT_S16_LE,
 };
-static int parse_hdmi_device_number();
 
 #define CHANNEL_MASK_MAX 3
 struct audio_device {
@@ -126,8 +129,11 @@ struct audio_device {
     bool standby;
     int sink_sup_channels;
     audio_channel_mask_t sup_channel_masks[CHANNEL_MASK_MAX];
+    struct card_registry cards;
 };
 
+static int parse_hdmi_device_number(struct audio_device *adev);
+
 struct stream_out {
     struct audio_stream_out stream;
 
@@ -145,6 +151,9 @@ struct stream_out {
     uint32_t   channels;
     uint32_t   latency;
 
+/* Error pacing timeline, updated under lock */
+    struct stream_pacer pacer;
+
     struct audio_device *dev;
 };
 
@@ -157,32 +166,20 @@ struct stream_out {
 
 // This function return the card number associated with the card ID (name)
 // passed as argument
-static int get_card_number_by_name(const char* name)
+static int get_card_number_by_name(struct audio_device *adev, const char* name)
 {
-    char id_filepath[PATH_MAX] = {0};
-    char number_filepath[PATH_MAX] = {0};
-    ssize_t written;
-
-    snprintf(id_filepath, sizeof(id_filepath), "/proc/asound/%s", name);
-
-    written = readlink(id_filepath, number_filepath, sizeof(number_filepath));
-    if (written < 0) {
-        ALOGE("Sound card PCH does not exist - checking for sofhdadsp sound card");
-        snprintf(id_filepath, sizeof(id_filepath), "/proc/asound/%s", "sofhdadsp");
-        written = readlink(id_filepath, number_filepath, sizeof(number_filepath));
-        if (written < 0) {
+    int card = card_registry_find(&adev->cards, name);
+
+    if (card < 0) {
+        ALOGE("Sound card %s does not exist - checking for sofhdadsp sound card", name);
+        card = card_registry_find(&adev->cards, "sofhdadsp");
+        if (card < 0) {
             ALOGE("Sound card %s does not exist - setting default", name);
             return DEFAULT_CARD;
-	}
-    } else if (written >= (ssize_t)sizeof(id_filepath)) {
-        ALOGE("Sound card %s name is too long - setting default", name);
-        return DEFAULT_CARD;
+        }
     }
 
-    // We are assured, because of the check in the previous elseif, that this
-    // buffer is null-terminated.  So this call is safe.
-    // 4 == strlen("card")
-    return atoi(number_filepath + 4);
+    return card;
 }
 
 static enum pcm_format Get_SinkSupported_format()
@@ -244,7 +241,7 @@ static int start_output_stream(struct stream_out *out)
         /*this will be updated once the hot plug intent
           sends these information.*/
         adev->card = DEFAULT_CARD; 
-        adev->device = parse_hdmi_device_number();
+        adev->device = parse_hdmi_device_number(adev);
         if (adev->device < 0) {
             ALOGE ("%s : Error while parsing the mixer controls, assigning the default device", __func__);
             adev->device = DEFAULT_DEVICE;
@@ -275,7 +272,7 @@ static int start_output_stream(struct stream_out *out)
 
     /*TODO - this needs to be updated once the device connect intent sends
       card, device id*/
-    adev->card = get_card_number_by_name("PCH");
+    adev->card = get_card_number_by_name(adev, "PCH");
    
     
     ALOGD("%s: HDMI card number = %d, device = %d",__func__,adev->card,adev->device);
@@ -428,7 +425,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
     ALOGV("%s exit",__func__);
     return 0;
 }
-static int parse_hdmi_device_number()
+static int parse_hdmi_device_number(struct audio_device *adev)
 {
     struct mixer *mixer = NULL;
     int card = 0;
@@ -439,7 +436,7 @@ static int parse_hdmi_device_number()
     bool device_status;
 
     ALOGV("%s enter",__func__);
-    card = get_card_number_by_name("PCH"); 
+    card = get_card_number_by_name(adev, "PCH");
     mixer = mixer_open(card);
     if (mixer == NULL) {
         ALOGE(" Failed to open mixer\n");
@@ -476,7 +473,7 @@ static int parse_hdmi_device_number()
     ALOGV("%s exit",__func__);
     return DEFAULT_DEVICE;
 }
-static int parse_channel_map()
+static int parse_channel_map(struct audio_device *adev)
 {
     struct mixer *mixer;
     int card = 0;
@@ -490,7 +487,7 @@ static int parse_channel_map()
 
     enable_multi = property_get_bool("vendor.audio.hdmi_multichannel", false);
 
-    card = get_card_number_by_name("PCH");
+    card = get_card_number_by_name(adev, "PCH");
     mixer = mixer_open(card);
     if (!mixer) {
         ALOGE("[EDID] Failed to open mixer\n");
@@ -555,7 +552,7 @@ static int out_read_edid(const struct stream_out *stream)
     struct audio_device *adev = out->dev;
 
     /**read the channel max param from the sink*/
-    adev->sink_sup_channels = parse_channel_map();
+    adev->sink_sup_channels = parse_channel_map(adev);
 
     if(adev->sink_sup_channels == 8) {
       adev->sup_channel_masks[0] = AUDIO_CHANNEL_OUT_5POINT1;
@@ -650,6 +647,7 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     struct stream_out *out = (struct stream_out *)stream;
     int32_t* dstbuff = NULL;
     int outbytes = 0;
+    int64_t deadline_ns = 0;
 
     ALOGV("%s enter for bytes = %zu channels = %d",__func__,bytes, out->pcm_config.channels);
 
@@ -702,15 +700,17 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     free(dstbuff);
 
 err:
+    if (ret != 0)
+        deadline_ns = stream_pacer_advance(&out->pacer, bytes / audio_stream_out_frame_size(stream),
+                                           out_get_sample_rate(&stream->common));
+    else
+        stream_pacer_reset(&out->pacer);
     pthread_mutex_unlock(&out->lock);
     pthread_mutex_unlock(&out->dev->lock);
 
    if(ret !=0){
-    uint64_t duration_ms = ((bytes * 1000)/
-                            (audio_stream_out_frame_size(stream)) /
-                            (out_get_sample_rate(&stream->common)));
     ALOGV("%s : silence written", __func__);
-    usleep(duration_ms * 1000);
+    stream_pacer_sleep_until(deadline_ns);
    }
 
     ALOGV("%s exit",__func__);
@@ -987,6 +987,9 @@ static int adev_dump(const audio_hw_device_t *device, int fd)
 
 static int adev_close(hw_device_t *device)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+
+    card_registry_release(&adev->cards);
     free(device);
     return 0;
 }
@@ -1025,6 +1028,8 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.close_input_stream = adev_close_input_stream;
     adev->hw_device.dump = adev_dump;
 
+    card_registry_init(&adev->cards);
+
     *device = &adev->hw_device.common;
 
     ALOGV("%s exit",__func__);
@@ -19,7 +19,12 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
-	audio_hw.c
+	audio_hw.c \
+	mmap_pcm.c \
+	sco_fir.c \
+	../common/pcm_dump.c \
+	../common/stream_pacer.c \
+	../common/card_registry.c
 
 LOCAL_SHARED_LIBRARIES := \
 	liblog \
@@ -30,6 +35,7 @@ LOCAL_SHARED_LIBRARIES := \
 	libdl
 
 LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/../common \
 	external/tinyalsa/include \
 	$(call include-path-for, audio-utils) \
 	$(call include-path-for, audio-route) \
@@ -59,4 +65,45 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
 
+# Bit exactness and throughput of the SIMD FIR kernels against the scalar one,
+# run with: $(HOST_OUT_EXECUTABLES)/audio_primary_sco_fir_test
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	tests/sco_fir_test.c \
+	sco_fir.c
+
+LOCAL_SHARED_LIBRARIES := liblog
+
+LOCAL_CFLAGS := -Werror -Wall
+
+LOCAL_MODULE := audio_primary_sco_fir_test
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# MMAP_NOIRQ buffer and position math against a fake tinyalsa backend,
+# run with: $(HOST_OUT_EXECUTABLES)/audio_primary_mmap_pcm_test
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	tests/mmap_pcm_test.c \
+	mmap_pcm.c
+
+LOCAL_SHARED_LIBRARIES := liblog
+
+LOCAL_C_INCLUDES += \
+	external/tinyalsa/include
+
+LOCAL_HEADER_LIBRARIES += libhardware_headers
+
+LOCAL_CFLAGS := -Werror -Wall
+
+LOCAL_MODULE := audio_primary_mmap_pcm_test
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
 endif # INTEL_AUDIO_HAL
@@ -20,10 +20,16 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <log/log.h>
@@ -39,10 +45,18 @@
 #include <sound/asound.h>
 #include <tinyalsa/asoundlib.h>
 
-#include <audio_utils/channels.h>
-#include <audio_utils/resampler.h>
 #include <audio_route/audio_route.h>
 
+#include "pcm_dump.h"
+#include "stream_pacer.h"
+#include "card_registry.h"
+#include "mmap_pcm.h"
+#include "sco_fir.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #define PCM_CARD 0
 #define PCM_CARD_DEFAULT 0
 #define PCM_DEVICE 0
@@ -51,30 +65,99 @@
 #define OUT_PERIOD_COUNT 4
 #define OUT_SAMPLING_RATE 48000
 
+#define OUT_FAST_PERIOD_SIZE 240 //5 ms
+#define OUT_FAST_PERIOD_COUNT 2
+
+#define OUT_DEEP_PERIOD_MS 100
+#define OUT_DEEP_PERIOD_COUNT 4
+
+#define MMAP_PERIOD_SIZE (OUT_SAMPLING_RATE / 1000) //1 ms bursts
+
+#define OUT_SRC_CHUNK_FRAMES 1024 //client frames converted per pass
+
+#define OUT_STANDBY_DELAY_MS_DEFAULT 2000
+#define OUT_STANDBY_DELAY_PROPERTY "vendor.audio.standby_delay_ms"
+#define OUT_XRUN_PREFILL_PROPERTY "vendor.audio.xrun_prefill"
+#define MASTER_VOLUME_CTL_PROPERTY "vendor.audio.master_volume_ctl"
+#define MASTER_VOLUME_CTL_DEFAULT "Master Playback Volume"
+#define MASTER_MUTE_CTL_PROPERTY "vendor.audio.master_mute_ctl"
+#define MASTER_MUTE_CTL_DEFAULT "Master Playback Switch"
+#define JACK_EVENTS_PROPERTY "vendor.audio.jack_events"
+#define JACK_HEADPHONE_CTL_PROPERTY "vendor.audio.jack.headphone_ctl"
+#define JACK_HEADPHONE_CTL_DEFAULT "Headphone Jack"
+#define JACK_HEADSET_MIC_CTL_PROPERTY "vendor.audio.jack.headset_mic_ctl"
+#define JACK_HEADSET_MIC_CTL_DEFAULT "Headset Mic Jack"
+#define JACK_WAIT_MS 100 //how long adev_close() may wait for the jack thread
+#define AUDIO_PARAMETER_JACK_OUT "jack_out"
+#define AUDIO_PARAMETER_JACK_IN "jack_in"
+#define OUT_MIXER_PROPERTY "vendor.audio.out_mixer"
+#define OUT_MIXER_PERIOD_COUNT 4
+#define OUT_MIXER_MAX_STREAMS 8
+#define OUT_MIXER_RETRY_MS 100
+#define OUT_MIXER_NICE (-16) /* ANDROID_PRIORITY_AUDIO */
+
 #define IN_PERIOD_SIZE 1024 //default period size
 #define IN_PERIOD_MS 10
 #define IN_PERIOD_COUNT 4
 #define IN_SAMPLING_RATE 48000
+#define IN_CONV_CHUNK_FRAMES 1024 //card frames converted per pass
+#define IN_HUB_PROPERTY "vendor.audio.in_hub"
+#define IN_HUB_PERIODS 8 //history readers can fall behind by
+#define IN_HUB_MAX_STREAMS 8
+#define IN_HUB_RETRY_MS 100
+#define IN_HUB_NICE (-16) /* ANDROID_PRIORITY_AUDIO */
+#define IN_PREROLL_PROPERTY "vendor.audio.in_preroll_ms"
+#define IN_PREROLL_MS_MAX 10000
+#define IN_PREROLL_NICE 10 /* ANDROID_PRIORITY_BACKGROUND, while nobody reads */
+#define AUDIO_PARAMETER_PREROLL_MS "preroll_ms"
 
 #define AUDIO_PARAMETER_HFP_ENABLE   "hfp_enable"
 #define AUDIO_PARAMETER_BT_SCO       "BT_SCO"
 #define AUDIO_BT_DRIVER_NAME         "btaudiosource"
+#define BT_SCO_SAMPLING_RATE         8000
 #define SAMPLE_SIZE_IN_BYTES          2
 #define SAMPLE_SIZE_IN_BYTES_STEREO   4
 
-//#define DEBUG_PCM_DUMP
-
-#ifdef DEBUG_PCM_DUMP
-// To enable dumps, explicitly create "/vendor/dump/" folder and reboot device
-FILE *sco_call_write = NULL;
-FILE *sco_call_write_remapped = NULL;
-FILE *sco_call_write_bt = NULL;
-FILE *sco_call_read = NULL;
-FILE *sco_call_read_remapped = NULL;
-FILE *sco_call_read_bt = NULL;
-FILE *out_write_dump = NULL;
-FILE *in_read_dump = NULL;
-#endif
+/* mixer paths driven by select_devices(), see route_path_names */
+enum {
+    ROUTE_SPEAKER_BIT,
+    ROUTE_HEADPHONE_BIT,
+    ROUTE_MAIN_MIC_BIT,
+    ROUTE_HEADSET_MIC_BIT,
+    ROUTE_COUNT
+};
+
+/*
+ * Control state published to the audio threads: the low bits mirror the
+ * audio_device flags of the same name, the upper bits are a generation that
+ * moves on every change.
+ */
+#define CTL_OUT_NEEDS_STANDBY        (1u << 0)
+#define CTL_IN_NEEDS_STANDBY         (1u << 1)
+#define CTL_HFP_CALL_ACTIVE          (1u << 2)
+#define CTL_SCO_VOIP_CALL            (1u << 3)
+#define CTL_FLAGS_MASK               0xfu
+#define CTL_GENERATION_INC           0x10u
+
+/*
+ * pcm_dump taps, switched at runtime with the PCM_DUMP_PARAMETER key. Streams
+ * write concurrently and have their own, out_write_<handle> and
+ * in_read_<handle>.
+ */
+enum {
+    DUMP_SCO_CALL_WRITE,
+    DUMP_SCO_CALL_WRITE_BT,
+    DUMP_SCO_CALL_READ,
+    DUMP_SCO_CALL_READ_BT,
+    DUMP_TAP_COUNT,
+};
+
+static const char * const dump_tap_names[DUMP_TAP_COUNT] = {
+    [DUMP_SCO_CALL_WRITE] = "sco_call_write",
+    [DUMP_SCO_CALL_WRITE_BT] = "sco_call_write_bt",
+    [DUMP_SCO_CALL_READ] = "sco_call_read",
+    [DUMP_SCO_CALL_READ_BT] = "sco_call_read_bt",
+};
 
 struct pcm_config pcm_config_out = {
     .channels = 2,
@@ -85,6 +168,41 @@ struct pcm_config pcm_config_out = {
     .start_threshold = OUT_PERIOD_SIZE * OUT_PERIOD_COUNT,
 };
 
+/* AUDIO_OUTPUT_FLAG_FAST: start as soon as one period is queued */
+struct pcm_config pcm_config_out_fast = {
+    .channels = 2,
+    .rate = OUT_SAMPLING_RATE,
+    .period_size = OUT_FAST_PERIOD_SIZE,
+    .period_count = OUT_FAST_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = OUT_FAST_PERIOD_SIZE,
+    .stop_threshold = OUT_FAST_PERIOD_SIZE * OUT_FAST_PERIOD_COUNT,
+    .avail_min = OUT_FAST_PERIOD_SIZE,
+};
+
+/* software mixer, the period comes from the attached streams, see out_mixer_config() */
+struct pcm_config pcm_config_out_mixer = {
+    .channels = 2,
+    .rate = OUT_SAMPLING_RATE,
+    .period_size = OUT_PERIOD_SIZE,
+    .period_count = OUT_MIXER_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+};
+
+/* AUDIO_OUTPUT_FLAG_MMAP_NOIRQ: period_count is sized in create_mmap_buffer */
+struct pcm_config pcm_config_out_mmap = {
+    .channels = 2,
+    .rate = OUT_SAMPLING_RATE,
+    .period_size = MMAP_PERIOD_SIZE,
+    .period_count = MMAP_PERIOD_COUNT_MAX,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = MMAP_PERIOD_SIZE * 8,
+    .stop_threshold = INT32_MAX,
+    .silence_threshold = 0,
+    .silence_size = 0,
+    .avail_min = MMAP_PERIOD_SIZE,
+};
+
 struct pcm_config pcm_config_in = {
     .channels = 2,
     .rate = IN_SAMPLING_RATE,
@@ -95,10 +213,24 @@ struct pcm_config pcm_config_in = {
     .stop_threshold = (IN_PERIOD_SIZE * IN_PERIOD_COUNT),
 };
 
+/* AUDIO_INPUT_FLAG_MMAP_NOIRQ: period_count is sized in create_mmap_buffer */
+struct pcm_config pcm_config_in_mmap = {
+    .channels = 2,
+    .rate = IN_SAMPLING_RATE,
+    .period_size = MMAP_PERIOD_SIZE,
+    .period_count = MMAP_PERIOD_COUNT_MAX,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = 0,
+    .stop_threshold = INT32_MAX,
+    .silence_threshold = 0,
+    .silence_size = 0,
+    .avail_min = MMAP_PERIOD_SIZE,
+};
+
 //[ BT ALSA Card config
 struct pcm_config bt_out_config = {
     .channels = 1,
-    .rate = 8000,
+    .rate = BT_SCO_SAMPLING_RATE,
     .period_size = 240,
     .period_count = 5,
     .start_threshold = 0,
@@ -110,7 +242,7 @@ struct pcm_config bt_out_config = {
 
 struct pcm_config bt_in_config = {
     .channels = 1,
-    .rate = 8000,
+    .rate = BT_SCO_SAMPLING_RATE,
     .period_size = 240,
     .period_count = 5,
     .start_threshold = 0,
@@ -120,6 +252,527 @@ struct pcm_config bt_in_config = {
     .avail_min = 0
 };
 
+//[BT SCO VoIP Call
+#if (OUT_SAMPLING_RATE != BT_SCO_SAMPLING_RATE * SCO_RESAMPLE_RATIO) || \
+    (IN_SAMPLING_RATE != BT_SCO_SAMPLING_RATE * SCO_RESAMPLE_RATIO)
+#error "SCO rate conversion kernel only supports a 6:1 ratio"
+#endif
+//BT SCO VoIP Call]
+
+//[BT SCO VoIP Call
+/*
+ * Scratch buffers for one direction of the SCO VoIP path. They are allocated
+ * once when BT_SCO=on is handled so that out_write()/in_read() never touch the
+ * heap while a call is active.
+ */
+struct sco_scratch {
+    void *base;
+    int16_t *buf_in;
+    int16_t *buf_out;
+    size_t size_in;
+    size_t size_out;
+};
+
+/*
+ * Echo reference for the SCO VoIP path. The downlink filter writes its 8 kHz
+ * output straight into the next block of this ring and the block goes to the
+ * BT card from there, one BT period at a time, so the reference costs no copy
+ * in out_write(). Each block
+ * carries the time its first frame is due at the card. AUDIO_SOURCE_ECHO_REFERENCE
+ * inputs copy blocks out without a lock: gen is a seqlock, odd while the writer
+ * fills the block, so a copy that does not see the same even gen before and
+ * after is thrown away.
+ */
+#define ECHO_REF_BLOCKS         32
+#define ECHO_REF_BLOCK_FRAMES   256
+
+struct echo_ref_block {
+    atomic_uint_least64_t gen; /* 2 * n + 1 while block n is written, 2 * n + 2 once published */
+    int64_t play_ns; /* CLOCK_MONOTONIC time the first frame reaches the card */
+    uint32_t frames;
+    int16_t data[ECHO_REF_BLOCK_FRAMES];
+};
+
+struct echo_ref {
+    atomic_uint_least64_t seq; /* blocks published */
+    struct echo_ref_block blocks[ECHO_REF_BLOCKS];
+};
+//BT SCO VoIP Call]
+
+/*
+ * Streaming rational resampler for client rates the cards don't run at. The
+ * low-pass prototype is designed at open time for rate_in * up, split into
+ * `up` polyphase branches of `taps` coefficients each normalized to unity DC
+ * gain, and every output frame evaluates the one branch it falls on with
+ * fir_dot_s16(), per channel.
+ */
+#define SRC_MAX_UP                  640
+#define SRC_MIN_PHASE_TAPS          48
+#define SRC_MAX_CHANNELS            2
+#define SRC_SHIFT                   14
+#define SRC_KAISER_BETA             7.0
+#define SRC_CUTOFF                  0.91 /* fraction of the lower Nyquist rate */
+
+struct stream_src {
+    uint32_t rate_in;
+    uint32_t rate_out;
+    unsigned int up;
+    unsigned int down;
+    unsigned int taps;
+    unsigned int channels;
+    size_t max_frames;      /* input frames per stream_src_process() call */
+    uint64_t pos;           /* next output, in up-sampled input frames */
+    int16_t *phases;        /* up branches of taps, reversed for fir_dot_s16() */
+    int16_t *line[SRC_MAX_CHANNELS]; /* taps - 1 history frames, then new input */
+};
+
+static unsigned int gcd_u32(unsigned int a, unsigned int b)
+{
+    while (b != 0) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static double bessel_i0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    int k;
+
+    for (k = 1; k < 64; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static void stream_src_destroy(struct stream_src *src)
+{
+    unsigned int c;
+
+    if (src == NULL)
+        return;
+    for (c = 0; c < SRC_MAX_CHANNELS; c++)
+        free(src->line[c]);
+    free(src->phases);
+    free(src);
+}
+
+static void stream_src_reset(struct stream_src *src)
+{
+    unsigned int c;
+
+    src->pos = 0;
+    for (c = 0; c < src->channels; c++)
+        memset(src->line[c], 0, (src->taps - 1) * sizeof(int16_t));
+}
+
+/* largest output of one stream_src_process() call */
+static size_t stream_src_max_output(const struct stream_src *src)
+{
+    return src->max_frames * src->up / src->down + 2;
+}
+
+static struct stream_src *stream_src_create(uint32_t rate_in, uint32_t rate_out,
+                                            unsigned int channels, size_t max_frames)
+{
+    struct stream_src *src;
+    unsigned int g = gcd_u32(rate_in, rate_out);
+    unsigned int up = rate_out / g;
+    unsigned int down = rate_in / g;
+    unsigned int taps = SRC_MIN_PHASE_TAPS;
+    unsigned int n, p, j, c;
+    double fc, center, *branch;
+
+    if (up > SRC_MAX_UP || channels == 0 || channels > SRC_MAX_CHANNELS) {
+        ALOGE("%s : unsupported conversion %u -> %u, %u channels", __func__,
+                rate_in, rate_out, channels);
+        return NULL;
+    }
+
+    /* keep the transition band proportionate when decimating */
+    if (down > up)
+        taps = (((SRC_MIN_PHASE_TAPS * down + up - 1) / up) + 15) & ~15;
+
+    src = (struct stream_src *)calloc(1, sizeof(struct stream_src));
+    branch = (double *)calloc(taps, sizeof(double));
+    if (!src || !branch)
+        goto error;
+
+    src->rate_in = rate_in;
+    src->rate_out = rate_out;
+    src->up = up;
+    src->down = down;
+    src->taps = taps;
+    src->channels = channels;
+    src->max_frames = max_frames;
+    src->phases = (int16_t *)calloc((size_t)up * taps, sizeof(int16_t));
+    if (!src->phases)
+        goto error;
+    for (c = 0; c < channels; c++) {
+        src->line[c] = (int16_t *)calloc(taps - 1 + max_frames, sizeof(int16_t));
+        if (!src->line[c])
+            goto error;
+    }
+
+    /* cutoff in cycles per up-sampled frame */
+    fc = SRC_CUTOFF * 0.5 * (rate_in < rate_out ? rate_in : rate_out) / ((double)rate_in * up);
+    n = up * taps;
+    center = (n - 1) / 2.0;
+
+    for (p = 0; p < up; p++) {
+        double sum = 0.0;
+        int32_t qsum = 0;
+        unsigned int peak = 0;
+
+        for (j = 0; j < taps; j++) {
+            double k = p + (double)j * up;
+            double x = k - center;
+            double r = 2.0 * k / (n - 1) - 1.0;
+            double sinc = x == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x);
+
+            branch[j] = sinc * bessel_i0(SRC_KAISER_BETA * sqrt(1.0 - r * r)) /
+                    bessel_i0(SRC_KAISER_BETA);
+            sum += branch[j];
+        }
+        for (j = 0; j < taps; j++) {
+            int16_t q = (int16_t)lrint(branch[j] / sum * (1 << SRC_SHIFT));
+
+            src->phases[p * taps + taps - 1 - j] = q;
+            qsum += q;
+            if (abs(q) > abs(src->phases[p * taps + taps - 1 - peak]))
+                peak = j;
+        }
+        /* put the rounding error on the largest tap so DC gain is exact */
+        src->phases[p * taps + taps - 1 - peak] += (1 << SRC_SHIFT) - qsum;
+    }
+
+    free(branch);
+    fir_kernels_init();
+    stream_src_reset(src);
+
+    ALOGI("%s : %u -> %u, up %u down %u, %u taps per branch", __func__,
+            rate_in, rate_out, up, down, taps);
+    return src;
+
+error:
+    ALOGE("%s : out of memory", __func__);
+    free(branch);
+    stream_src_destroy(src);
+    return NULL;
+}
+
+/*
+ * Converts frames (at most max_frames) interleaved frames into out, which must
+ * hold stream_src_max_output() frames. Returns the number of frames produced.
+ */
+static size_t stream_src_process(struct stream_src *src, const int16_t *in, size_t frames,
+                                 int16_t *out)
+{
+    unsigned int channels = src->channels;
+    unsigned int taps = src->taps;
+    size_t produced = 0;
+    size_t i;
+    unsigned int c;
+
+    for (c = 0; c < channels; c++) {
+        int16_t *line = src->line[c] + taps - 1;
+
+        for (i = 0; i < frames; i++)
+            line[i] = in[i * channels + c];
+    }
+
+    while (src->pos / src->up < frames) {
+        size_t idx = src->pos / src->up;
+        const int16_t *branch = src->phases + (src->pos % src->up) * taps;
+
+        for (c = 0; c < channels; c++)
+            out[produced * channels + c] = fir_round_sat(
+                    fir_dot_s16(src->line[c] + idx, branch, taps), SRC_SHIFT);
+        produced++;
+        src->pos += src->down;
+    }
+    src->pos -= (uint64_t)frames * src->up;
+
+    for (c = 0; c < channels; c++)
+        memmove(src->line[c], src->line[c] + frames, (taps - 1) * sizeof(int16_t));
+
+    return produced;
+}
+
+/*
+ * Input frames the next stream_src_process() calls need to produce frames
+ * output frames. Exact when decimating, as each input frame then yields at
+ * most one output frame.
+ */
+static size_t stream_src_input_frames(const struct stream_src *src, size_t frames)
+{
+    if (frames == 0)
+        return 0;
+    return (src->pos + (uint64_t)(frames - 1) * src->down) / src->up + 1;
+}
+
+/* averages interleaved stereo frames into mono, in place */
+static void fold_stereo_to_mono(int16_t *buf, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i ones = _mm_set1_epi16(1);
+
+    /* eight frames per pass, each store lands behind the next load */
+    for (; i + 8 <= frames; i += 8) {
+        __m128i lo = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(buf + 2 * i)), ones);
+        __m128i hi = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(buf + 2 * i + 8)), ones);
+
+        lo = _mm_srai_epi32(lo, 1);
+        hi = _mm_srai_epi32(hi, 1);
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < frames; i++)
+        buf[i] = (int16_t)(((int32_t)buf[2 * i] + buf[2 * i + 1]) >> 1);
+}
+
+/*
+ * Software gain for streams and master volume when the card has no control
+ * for it. Gains are Q15, left in the low and right in the high half of a
+ * packed word so setters on other threads can publish them atomically. A
+ * change of target is ramped per frame over GAIN_RAMP_MS to avoid clicks, the
+ * rest of the buffer is scaled with SSE2.
+ */
+#define GAIN_UNITY                  32768
+#define GAIN_PACKED_UNITY           (GAIN_UNITY | (GAIN_UNITY << 16))
+#define GAIN_RAMP_MS                5
+
+struct gain_ramp {
+    unsigned int to;    /* packed target of the current or last ramp */
+    float cur[2];       /* Q15 */
+    float step[2];
+    size_t remaining;
+};
+
+static inline unsigned int gain_to_q15(float gain)
+{
+    if (!(gain > 0.0f))
+        return 0;
+    if (gain >= 1.0f)
+        return GAIN_UNITY;
+    return (unsigned int)lrintf(gain * GAIN_UNITY);
+}
+
+static inline unsigned int gain_pack(unsigned int left, unsigned int right)
+{
+    return left | (right << 16);
+}
+
+static inline unsigned int gain_channel(unsigned int packed, unsigned int c)
+{
+    return (packed >> (16 * c)) & 0xffff;
+}
+
+static void gain_ramp_init(struct gain_ramp *g)
+{
+    g->to = GAIN_PACKED_UNITY;
+    g->cur[0] = g->cur[1] = GAIN_UNITY;
+    g->step[0] = g->step[1] = 0.0f;
+    g->remaining = 0;
+}
+
+/* true when gain_apply() would leave the buffer untouched */
+static bool gain_is_unity(const struct gain_ramp *g, unsigned int target)
+{
+    return target == GAIN_PACKED_UNITY && g->to == target && g->remaining == 0;
+}
+
+/* samples alternate between g_even and g_odd, both below GAIN_UNITY */
+static void gain_scale_q15(int16_t *buf, size_t samples, int16_t g_even, int16_t g_odd)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i gv = _mm_set_epi16(g_odd, g_even, g_odd, g_even,
+                                     g_odd, g_even, g_odd, g_even);
+    const __m128i round = _mm_set1_epi32(1 << 14);
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i lo = _mm_mullo_epi16(x, gv);
+        __m128i hi = _mm_mulhi_epi16(x, gv);
+        __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 15);
+        __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 15);
+
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_packs_epi32(p0, p1));
+    }
+#endif
+    for (; i < samples; i++) {
+        int32_t g = (i & 1) ? g_odd : g_even;
+
+        buf[i] = (int16_t)((buf[i] * g + (1 << 14)) >> 15);
+    }
+}
+
+/*
+ * Applies the packed target gain to frames interleaved frames of one or two
+ * channels, ramping from the previous gain over ramp_frames.
+ */
+static void gain_apply(struct gain_ramp *g, unsigned int target, int16_t *buf,
+                       size_t frames, unsigned int channels, size_t ramp_frames)
+{
+    unsigned int left, right, c;
+    size_t i = 0;
+
+    if (target != g->to) {
+        if (ramp_frames == 0)
+            ramp_frames = 1;
+        for (c = 0; c < 2; c++)
+            g->step[c] = ((float)gain_channel(target, c) - g->cur[c]) / ramp_frames;
+        g->to = target;
+        g->remaining = ramp_frames;
+    }
+
+    for (; i < frames && g->remaining > 0; i++) {
+        g->remaining--;
+        for (c = 0; c < 2; c++)
+            g->cur[c] = g->remaining > 0 ? g->cur[c] + g->step[c] : gain_channel(g->to, c);
+        for (c = 0; c < channels; c++) {
+            int16_t *sample = &buf[i * channels + c];
+
+            *sample = (int16_t)lrintf(*sample * g->cur[channels == 2 ? c : 0] / GAIN_UNITY);
+        }
+    }
+    if (i == frames)
+        return;
+
+    left = gain_channel(g->to, 0);
+    right = channels == 2 ? gain_channel(g->to, 1) : left;
+    if (left == GAIN_UNITY && right == GAIN_UNITY)
+        return;
+    if (left == 0 && right == 0) {
+        memset(buf + i * channels, 0, (frames - i) * channels * sizeof(int16_t));
+        return;
+    }
+    /* unity on one side only: 32767 is within a hundredth of a dB of it */
+    gain_scale_q15(buf + i * channels, (frames - i) * channels,
+            left < GAIN_UNITY ? left : GAIN_UNITY - 1,
+            right < GAIN_UNITY ? right : GAIN_UNITY - 1);
+}
+
+/*
+ * Per-stream counters for dumpsys. Updated by the stream's I/O thread and
+ * read by the dump without taking any lock, so every field is a relaxed
+ * atomic. Times are from the monotonic clock.
+ */
+#define STATS_IO_BUCKETS 10 /* time in pcm_write()/pcm_read(), see stats_bucket() */
+
+struct stream_stats {
+    atomic_uint_least64_t bytes;
+    atomic_uint_least64_t frames;
+    atomic_uint_least64_t io_calls;
+    atomic_uint_least64_t io_ns;
+    atomic_uint_least64_t io_max_ns;
+    atomic_uint_least64_t io_hist[STATS_IO_BUCKETS];
+    atomic_uint_least64_t lock_waits; /* for adev->lock, on the slow path */
+    atomic_uint_least64_t lock_wait_ns;
+    atomic_uint_least64_t lock_wait_max_ns;
+    atomic_uint_least64_t xruns;
+    atomic_uint_least64_t standbys;
+    atomic_uint_least64_t opens;
+    atomic_uint_least64_t open_ns;
+    atomic_uint_least64_t open_max_ns;
+};
+
+/*
+ * Software mixer for the primary card. While several outputs that are neither
+ * mmap nor in a call play at once they don't open the pcm themselves:
+ * out_write() pushes card format frames into the stream's ring and
+ * out_mixer_worker() sums the rings of all attached streams into the one pcm
+ * it owns. A lone output keeps the card to itself, see update_out_sharing().
+ * The card only changes hands once the pcm giving it up played out what it
+ * had queued, see out_mixer_retire().
+ */
+struct mix_ring {
+    int16_t *data;              /* stereo frames */
+    size_t frames;              /* capacity */
+    atomic_uint_least64_t head; /* frames pushed by out_write() */
+    atomic_uint_least64_t tail; /* frames taken by the mixer */
+};
+
+struct out_mixer {
+    pthread_t thread;
+    pthread_mutex_t lock;       /* after the output stream mutexes, see note below */
+    pthread_cond_t cond;        /* wakes the worker when streams come or go */
+    pthread_cond_t space_cond;  /* wakes writers once a period was taken */
+    bool thread_started;
+    bool thread_exit;
+    struct stream_out *streams[OUT_MIXER_MAX_STREAMS];
+    unsigned int count;
+    int card;
+    struct pcm *pcm;            /* only touched by the worker */
+    struct pcm_config config;   /* of the pcm, see out_mixer_config() */
+    bool card_busy;             /* a lone or mmap output has the card, see update_mixer_card() */
+    struct pcm *retired;        /* playing out its queue before the card changes hands */
+    int64_t retired_end_ns;     /* when it runs dry, closed by the worker then */
+    int16_t *buf;               /* one mixed period */
+    int16_t *silence;           /* one period of zeroes for the xrun prefill */
+    size_t buf_frames;
+    int64_t idle_deadline_ns;   /* the pcm is closed then if no stream came back */
+    /* when the last period was queued, see out_mixer_queued() */
+    int64_t queued_ns;
+    uint32_t queued;            /* frames in the pcm at queued_ns */
+    struct stream_stats stats;
+};
+
+/*
+ * Capture hub for the primary card, the input side of the mixer. Inputs that
+ * are neither mmap nor in a call don't open the pcm themselves: in_hub_worker()
+ * reads it a period at a time into one ring and every attached stream reads
+ * the ring from its own position, then converts what it took on its own.
+ */
+struct in_hub {
+    pthread_t thread;
+    pthread_mutex_t lock;       /* after the input stream mutexes, see note below */
+    pthread_cond_t cond;        /* wakes the worker when streams come or go */
+    pthread_cond_t data_cond;   /* wakes readers once a period was captured */
+    bool thread_started;
+    bool thread_exit;
+    struct stream_in *streams[IN_HUB_MAX_STREAMS];
+    unsigned int count;
+    int card;
+    struct pcm *pcm;            /* only touched by the worker */
+    int16_t *data;              /* IN_HUB_PERIODS periods of stereo frames */
+    size_t frames;
+    atomic_uint_least64_t head; /* frames captured into data */
+    /* pre-roll: the hub keeps capturing with no stream attached, 0 when off */
+    uint32_t preroll_ms;
+    uint64_t opened; /* head when the pcm was opened, older frames aren't contiguous */
+    /* card position after the last period, see in_hub_position() */
+    int64_t captured_ns;
+    uint64_t captured;
+    struct stream_stats stats;
+};
+
+/*
+ * Card indices and pcm_params of the primary card, probed at adev_open()
+ * and again only once the card registry reports cards coming or going.
+ */
+struct primary_cards {
+    struct card_registry registry;
+    uint32_t generation; /* registry generation the fields below were probed at */
+    bool valid;
+    int mixer_card;
+    int card_out;
+    int card_in;
+    struct pcm_params *params_out;
+    struct pcm_params *params_in;
+    int bt_card;
+};
+
 struct audio_device {
     struct audio_hw_device hw_device;
 
@@ -129,11 +782,18 @@ struct audio_device {
     bool standby;
     bool mic_mute;
     struct audio_route *ar;
+    unsigned int routes; /* ROUTE_*_BIT paths applied by select_devices() */
+    bool routes_valid;
     
+    struct primary_cards cards;
     int card;
     int cardc;
     struct stream_out *active_out;
     struct stream_in *active_in;
+    /* outputs that can be mixed: how many play, and the one on the card alone */
+    unsigned int outs_playing;
+    struct stream_out *out_direct;
+    struct stream_out *out_mmap; /* has PCM_DEVICE to itself, see out_create_mmap_buffer() */
 
 //[BT-HFP Voice Call
     bool is_hfp_call_active;
@@ -145,9 +805,68 @@ struct audio_device {
 //[BT SCO VoIP Call
     bool in_sco_voip_call;
     int bt_card;
-    struct resampler_itfe *voip_in_resampler;
-    struct resampler_itfe *voip_out_resampler;
+    struct sco_downlink voip_downlink;
+    struct sco_uplink voip_uplink;
+    struct sco_scratch sco_out_scratch;
+    struct sco_scratch sco_in_scratch;
+    struct echo_ref echo_ref;
+    size_t sco_out_fill; /* downlink samples in the echo reference block not yet written */
+    /* BT pcms opened ahead of the first call buffer, see sco_prepare() */
+    pthread_t sco_prep_thread;
+    pthread_cond_t sco_prep_cond;
+    bool sco_prep_thread_started;
+    bool sco_prep_thread_exit;
+    bool sco_prep_pending;
+    bool sco_prep_busy; /* the worker is opening pcms without the mutex */
+    unsigned int sco_prep_gen; /* bumped by release_sco_resources() */
+    struct pcm *sco_pcm_out;
+    struct pcm *sco_pcm_in;
+    /* streams running on the BT pcms, the only users of the scratch buffers */
+    struct stream_out *sco_out;
+    struct stream_in *sco_in;
 //BT SCO VoIP Call]
+
+    /*
+     * Snapshot of the flags above, see publish_ctl_state(). out_write() and
+     * in_read() only take the hw device mutex when it changed.
+     */
+    atomic_uint ctl_state;
+    atomic_uint_least64_t ctl_fast_path_count;
+    atomic_uint_least64_t ctl_slow_path_count;
+
+    /* outputs kept warm after standby, closed by standby_worker() */
+    pthread_t standby_thread;
+    pthread_cond_t standby_cond;
+    bool standby_thread_started;
+    bool standby_thread_exit;
+    int standby_delay_ms;
+    struct stream_out *warm_outs;
+
+    bool xrun_prefill;
+
+    /* master volume, on the card controls when it has them */
+    struct mixer *mixer;
+    struct mixer_ctl *master_volume_ctl;
+    struct mixer_ctl *master_mute_ctl;
+    float master_volume;
+    bool master_mute;
+    atomic_uint master_gain; /* packed Q15 left to the outputs */
+
+    /* jack kcontrols, followed by jack_worker() on a mixer of its own */
+    pthread_t jack_thread;
+    bool jack_thread_started;
+    atomic_bool jack_thread_exit;
+    struct mixer *jack_mixer;
+    struct mixer_ctl *headphone_jack_ctl;
+    struct mixer_ctl *headset_mic_jack_ctl;
+    atomic_uint jack_out; /* AUDIO_DEVICE_OUT_* plugged in, 0 when nothing is */
+    atomic_uint jack_in; /* same for capture, without AUDIO_DEVICE_BIT_IN like in_device */
+
+    struct pcm_dump *dump;
+    struct pcm_dump_tap *dump_taps[DUMP_TAP_COUNT];
+
+    struct out_mixer out_mixer;
+    struct in_hub in_hub;
 };
 
 struct stream_out {
@@ -156,10 +875,40 @@ struct stream_out {
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
     struct pcm *pcm;
     struct pcm_config *pcm_config;
+    struct pcm_config config; /* per-stream profile: deep buffer, mmap */
+    audio_output_flags_t flags;
     struct audio_config req_config;
     bool unavailable;
     bool standby;
     uint64_t written;
+    unsigned int ctl_state; /* control state seen on the last slow path */
+    /* in standby with the pcm still open, see do_out_standby_delayed() */
+    bool warm;
+    int64_t warm_deadline_ns;
+    struct stream_out *warm_next;
+    /* underrun accounting, see recover_out_xrun(), the count is in stats */
+    uint64_t xrun_lost_ns;
+    uint64_t xrun_silence_frames;
+    int64_t drain_deadline_ns; /* when the queued frames run out */
+    uint64_t last_presented;
+    void *silence; /* one period of zeroes for the xrun prefill */
+    struct stream_pacer pacer;
+    /* client rate -> card rate, NULL when they match */
+    struct stream_src *src;
+    int16_t *src_buf;
+    /* set_volume() target, packed Q15, and its ramp in out_write() */
+    atomic_uint volume;
+    struct gain_ramp volume_ramp;
+    int16_t *gain_buf; /* copy of the client buffer when not at unity */
+    size_t gain_buf_size;
+    /* fed to adev->out_mixer instead of a pcm of its own, see out_mixer_attach() */
+    bool mixed;
+    atomic_bool mix_move; /* onto or off the mixer on the next write, see update_out_sharing() */
+    struct mix_ring ring; /* no data when the stream can't be mixed */
+    uint64_t mix_base; /* ring tail when the mixer last queued a period */
+    bool mix_fed; /* mixer private: the last period got a full ring read */
+    struct pcm_dump_tap *dump_tap;
+    struct stream_stats stats;
     struct audio_device *dev;
 };
 
@@ -169,108 +918,1926 @@ struct stream_in {
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
     struct pcm *pcm;
     struct pcm_config *pcm_config;
+    struct pcm_config config; /* per-stream profile: mmap */
+    audio_input_flags_t flags;
     struct audio_config req_config;
     bool unavailable;
     bool standby;
+    unsigned int ctl_state; /* control state seen on the last slow path */
+    struct stream_pacer pacer;
+
+    /* capture timeline, see update_capture_timeline() */
+    uint32_t pcm_rate; /* rate of the open pcm, 8 kHz on SCO */
+    uint64_t frames_read; /* frames handed to the client, silence included */
+    uint64_t frames_captured; /* frames_read plus frames dropped on overruns */
+    uint64_t frames_lost_total;
+    uint32_t frames_lost; /* since the last in_get_input_frames_lost() */
+    uint64_t hw_frames; /* pcm frames read or dropped since start */
+    int64_t last_capture_ns;
+    uint64_t last_hw_frames;
+
+//[BT SCO VoIP Call
+    /* converted uplink frames in sco_in_scratch.buf_out the client has not read yet */
+    size_t sco_offset;
+    size_t sco_avail;
+//BT SCO VoIP Call]
+
+    /* reading adev->in_hub instead of a pcm of its own, see in_hub_attach() */
+    bool hubbed;
+    bool hub_capable;
+    uint64_t hub_pos; /* next hub frame to read */
+    uint32_t preroll_ms; /* history the next start begins with */
+
+    /* card format -> req_config, see in_convert() */
+    bool fold_mono;
+    struct stream_src *src;
+    int16_t *conv_buf; /* IN_CONV_CHUNK_FRAMES card frames */
+
+    /* set_gain() target, packed Q15, mic mute ramps it to zero */
+    atomic_uint gain;
+    struct gain_ramp gain_ramp;
+
+//[BT SCO VoIP Call
+    /* AUDIO_SOURCE_ECHO_REFERENCE input, reads adev->echo_ref instead of a pcm */
+    bool echo_ref;
+    uint64_t ref_seq; /* next block to read */
+    uint32_t ref_offset; /* frames of it already read */
+    int64_t ref_next_ns; /* when the next frame reached the card, 0 before the first */
+//BT SCO VoIP Call]
+
+    struct pcm_dump_tap *dump_tap;
+    struct stream_stats stats;
 
     struct audio_device *dev;
 };
 
-static uint32_t out_get_sample_rate(const struct audio_stream *stream);
-static size_t out_get_buffer_size(const struct audio_stream *stream);
-static audio_format_t out_get_format(const struct audio_stream *stream);
-static uint32_t in_get_sample_rate(const struct audio_stream *stream);
-static size_t in_get_buffer_size(const struct audio_stream *stream);
-static audio_format_t in_get_format(const struct audio_stream *stream);
+static uint32_t out_get_sample_rate(const struct audio_stream *stream);
+static size_t out_get_buffer_size(const struct audio_stream *stream);
+static audio_format_t out_get_format(const struct audio_stream *stream);
+static uint32_t in_get_sample_rate(const struct audio_stream *stream);
+static size_t in_get_buffer_size(const struct audio_stream *stream);
+static audio_format_t in_get_format(const struct audio_stream *stream);
+
+static const char * const route_path_names[] = {
+    [ROUTE_SPEAKER_BIT] = "speaker",
+    [ROUTE_HEADPHONE_BIT] = "headphone",
+    [ROUTE_MAIN_MIC_BIT] = "main-mic",
+    [ROUTE_HEADSET_MIC_BIT] = "headset-mic",
+};
+
+/*
+ * must be called with hw device mutex locked. Only paths whose state changed
+ * since the last call are touched; audio_route_update_mixer() then writes just
+ * the controls that differ from what it last wrote.
+ */
+static void select_devices(struct audio_device *adev)
+{
+    unsigned int routes = 0;
+    unsigned int changed;
+    unsigned int i;
+
+    if (adev->out_device & AUDIO_DEVICE_OUT_SPEAKER)
+        routes |= 1u << ROUTE_SPEAKER_BIT;
+    if (adev->out_device & (AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE))
+        routes |= 1u << ROUTE_HEADPHONE_BIT;
+    if (adev->in_device & AUDIO_DEVICE_IN_BUILTIN_MIC)
+        routes |= 1u << ROUTE_MAIN_MIC_BIT;
+    if (adev->in_device & AUDIO_DEVICE_IN_WIRED_HEADSET)
+        routes |= 1u << ROUTE_HEADSET_MIC_BIT;
+
+    if (adev->routes_valid && routes == adev->routes) {
+        ALOGV("%s : routes %#x unchanged", __func__, routes);
+        return;
+    }
+
+    if (!adev->routes_valid) {
+        audio_route_reset(adev->ar);
+        changed = routes;
+    } else {
+        changed = routes ^ adev->routes;
+        for (i = 0; i < ROUTE_COUNT; i++) {
+            if ((changed & (1u << i)) && !(routes & (1u << i)))
+                audio_route_reset_path(adev->ar, route_path_names[i]);
+        }
+        /* paths may share controls, reapply whatever a reset could have undone */
+        if (changed & adev->routes)
+            changed |= routes;
+    }
+
+    for (i = 0; i < ROUTE_COUNT; i++) {
+        if ((changed & routes) & (1u << i))
+            audio_route_apply_path(adev->ar, route_path_names[i]);
+    }
+
+    audio_route_update_mixer(adev->ar);
+
+    adev->routes = routes;
+    adev->routes_valid = true;
+
+    ALOGV("%s : hp=%c speaker=%c main-mic=%c headset-mic=%c",__func__,
+      (routes & (1u << ROUTE_HEADPHONE_BIT)) ? 'y' : 'n', (routes & (1u << ROUTE_SPEAKER_BIT)) ? 'y' : 'n',
+      (routes & (1u << ROUTE_MAIN_MIC_BIT)) ? 'y' : 'n', (routes & (1u << ROUTE_HEADSET_MIC_BIT)) ? 'y' : 'n' );
+}
+
+/*
+ * must be called with hw device mutex locked, after any change to the flags
+ * mirrored in ctl_state. Paths that go on to lock a stream mutex while holding
+ * the hw device mutex must publish first so the audio thread backs off to the
+ * hw device mutex instead of re-taking the stream mutex.
+ */
+static void publish_ctl_state(struct audio_device *adev)
+{
+    unsigned int flags = 0;
+    unsigned int state;
+
+    if (adev->out_needs_standby)
+        flags |= CTL_OUT_NEEDS_STANDBY;
+    if (adev->in_needs_standby)
+        flags |= CTL_IN_NEEDS_STANDBY;
+    if (adev->is_hfp_call_active)
+        flags |= CTL_HFP_CALL_ACTIVE;
+    if (adev->in_sco_voip_call)
+        flags |= CTL_SCO_VOIP_CALL;
+
+    state = atomic_load_explicit(&adev->ctl_state, memory_order_relaxed);
+    state = ((state & ~CTL_FLAGS_MASK) + CTL_GENERATION_INC) | flags;
+    atomic_store_explicit(&adev->ctl_state, state, memory_order_release);
+}
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t frames_to_ns(uint64_t frames, uint32_t rate)
+{
+    return (int64_t)(frames / rate) * 1000000000LL +
+            (int64_t)(frames % rate) * 1000000000LL / rate;
+}
+
+static const char * const stats_bucket_names[STATS_IO_BUCKETS] = {
+    "<0.25", "<0.5", "<1", "<2", "<4", "<8", "<16", "<32", "<64", ">=64",
+};
+
+/* power of two buckets from 250 us, see stats_bucket_names */
+static unsigned int stats_bucket(int64_t ns)
+{
+    uint64_t q = ns > 0 ? (uint64_t)ns / 250000 : 0;
+    unsigned int b = q == 0 ? 0 : 64 - __builtin_clzll(q);
+
+    return b < STATS_IO_BUCKETS ? b : STATS_IO_BUCKETS - 1;
+}
+
+static void stats_add(atomic_uint_least64_t *counter, uint64_t v)
+{
+    atomic_fetch_add_explicit(counter, v, memory_order_relaxed);
+}
+
+static void stats_max(atomic_uint_least64_t *max, uint64_t v)
+{
+    uint64_t cur = atomic_load_explicit(max, memory_order_relaxed);
+
+    while (v > cur &&
+            !atomic_compare_exchange_weak_explicit(max, &cur, v,
+                    memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static uint64_t stats_get(const atomic_uint_least64_t *counter)
+{
+    return atomic_load_explicit((atomic_uint_least64_t *)counter, memory_order_relaxed);
+}
+
+static void stats_record_io(struct stream_stats *stats, int64_t ns)
+{
+    stats_add(&stats->io_calls, 1);
+    stats_add(&stats->io_ns, ns);
+    stats_max(&stats->io_max_ns, ns);
+    stats_add(&stats->io_hist[stats_bucket(ns)], 1);
+}
+
+static void stats_record_lock_wait(struct stream_stats *stats, int64_t ns)
+{
+    stats_add(&stats->lock_waits, 1);
+    stats_add(&stats->lock_wait_ns, ns);
+    stats_max(&stats->lock_wait_max_ns, ns);
+}
+
+static void stats_record_open(struct stream_stats *stats, int64_t ns)
+{
+    stats_add(&stats->opens, 1);
+    stats_add(&stats->open_ns, ns);
+    stats_max(&stats->open_max_ns, ns);
+}
+
+static int stats_pcm_write(struct stream_stats *stats, struct pcm *pcm,
+                           const void *data, unsigned int count)
+{
+    int64_t start = monotonic_ns();
+    int ret = pcm_write(pcm, data, count);
+
+    stats_record_io(stats, monotonic_ns() - start);
+    return ret;
+}
+
+/*
+ * After pcm_write() returned -EPIPE on a PCM_NORESTART pcm: primes the silence
+ * when there is some so the restarted pcm has headroom, then retries the
+ * buffer once. pcm_write() prepares the pcm again on its own.
+ */
+static int recover_pcm_xrun(struct stream_stats *stats, struct pcm *pcm,
+                            const void *silence, unsigned int silence_bytes,
+                            const void *buffer, unsigned int bytes)
+{
+    int ret;
+
+    if (silence != NULL) {
+        ret = stats_pcm_write(stats, pcm, silence, silence_bytes);
+        if (ret != 0)
+            return ret;
+    }
+
+    return stats_pcm_write(stats, pcm, buffer, bytes);
+}
+
+static int stats_pcm_read(struct stream_stats *stats, struct pcm *pcm,
+                          void *data, unsigned int count)
+{
+    int64_t start = monotonic_ns();
+    int ret = pcm_read(pcm, data, count);
+
+    stats_record_io(stats, monotonic_ns() - start);
+    return ret;
+}
+
+static void stats_dump(const struct stream_stats *stats, int fd, const char *io)
+{
+    uint64_t calls = stats_get(&stats->io_calls);
+    uint64_t waits = stats_get(&stats->lock_waits);
+    uint64_t opens = stats_get(&stats->opens);
+    unsigned int b;
+
+    dprintf(fd, "    %s: %" PRIu64 " bytes, %" PRIu64 " frames, %" PRIu64 " calls\n",
+            io, stats_get(&stats->bytes), stats_get(&stats->frames), calls);
+    dprintf(fd, "    time in %s: avg %" PRIu64 " us, max %" PRIu64 " us, ms histogram:",
+            io, calls ? stats_get(&stats->io_ns) / calls / 1000 : 0,
+            stats_get(&stats->io_max_ns) / 1000);
+    for (b = 0; b < STATS_IO_BUCKETS; b++)
+        dprintf(fd, " %s:%" PRIu64, stats_bucket_names[b], stats_get(&stats->io_hist[b]));
+    dprintf(fd, "\n");
+    dprintf(fd, "    device lock waits: %" PRIu64 ", avg %" PRIu64 " us, max %" PRIu64 " us\n",
+            waits, waits ? stats_get(&stats->lock_wait_ns) / waits / 1000 : 0,
+            stats_get(&stats->lock_wait_max_ns) / 1000);
+    dprintf(fd, "    xruns: %" PRIu64 ", standbys: %" PRIu64 ", pcm opens: %" PRIu64
+            ", avg %" PRIu64 " us, max %" PRIu64 " us\n",
+            stats_get(&stats->xruns), stats_get(&stats->standbys), opens,
+            opens ? stats_get(&stats->open_ns) / opens / 1000 : 0,
+            stats_get(&stats->open_max_ns) / 1000);
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static void unlink_warm_output(struct stream_out *out)
+{
+    struct stream_out **link = &out->dev->warm_outs;
+
+    while (*link != NULL && *link != out)
+        link = &(*link)->warm_next;
+    if (*link == out)
+        *link = out->warm_next;
+    out->warm_next = NULL;
+    out->warm = false;
+}
+
+/* dst += src, saturated to 16 bits */
+static void mix_add_s16(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= samples; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+    }
+#endif
+    for (; i < samples; i++) {
+        int32_t sum = dst[i] + src[i];
+
+        if (sum > INT16_MAX)
+            sum = INT16_MAX;
+        else if (sum < INT16_MIN)
+            sum = INT16_MIN;
+        dst[i] = (int16_t)sum;
+    }
+}
+
+static int mix_ring_alloc(struct mix_ring *ring, size_t frames)
+{
+    ring->data = (int16_t *)calloc(frames, SAMPLE_SIZE_IN_BYTES_STEREO);
+    if (ring->data == NULL)
+        return -ENOMEM;
+    ring->frames = frames;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+/* producer side, returns the frames that fit */
+static size_t mix_ring_write(struct mix_ring *ring, const int16_t *buf, size_t frames)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = ring->frames - (size_t)(head - tail);
+    size_t offset = head % ring->frames;
+    size_t first;
+
+    if (frames > space)
+        frames = space;
+    first = ring->frames - offset;
+    if (first > frames)
+        first = frames;
+    memcpy(ring->data + 2 * offset, buf, first * SAMPLE_SIZE_IN_BYTES_STEREO);
+    memcpy(ring->data, buf + 2 * first, (frames - first) * SAMPLE_SIZE_IN_BYTES_STEREO);
+    atomic_store_explicit(&ring->head, head + frames, memory_order_release);
+
+    return frames;
+}
+
+/* consumer side, adds up to frames frames into mix and returns how many */
+static size_t mix_ring_read_add(struct mix_ring *ring, int16_t *mix, size_t frames)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t offset = tail % ring->frames;
+    size_t first;
+
+    if (frames > head - tail)
+        frames = (size_t)(head - tail);
+    first = ring->frames - offset;
+    if (first > frames)
+        first = frames;
+    mix_add_s16(mix, ring->data + 2 * offset, 2 * first);
+    mix_add_s16(mix + 2 * first, ring->data, 2 * (frames - first));
+    atomic_store_explicit(&ring->tail, tail + frames, memory_order_release);
+
+    return frames;
+}
+
+/*
+ * must be called with the mixer mutex locked. The mixer goes at the pace of
+ * the most latency sensitive stream attached: the smallest period among their
+ * profiles, with at least OUT_MIXER_PERIOD_COUNT of them queued against the
+ * worker's own scheduling jitter.
+ */
+static void out_mixer_config(struct out_mixer *mix, struct pcm_config *config)
+{
+    unsigned int i;
+
+    *config = pcm_config_out_mixer;
+    for (i = 0; i < mix->count; i++) {
+        const struct pcm_config *profile = mix->streams[i]->pcm_config;
+
+        if (i == 0 || profile->period_size < config->period_size) {
+            config->period_size = profile->period_size;
+            config->period_count = profile->period_count > OUT_MIXER_PERIOD_COUNT ?
+                    profile->period_count : OUT_MIXER_PERIOD_COUNT;
+        }
+    }
+    config->start_threshold = config->period_size * 2;
+    config->stop_threshold = config->period_size * config->period_count;
+    config->avail_min = config->period_size;
+}
+
+/* must be called with the mixer mutex locked, by the worker */
+static int out_mixer_open(struct out_mixer *mix)
+{
+    int64_t start;
+
+    out_mixer_config(mix, &mix->config);
+    if (mix->buf_frames < mix->config.period_size) {
+        free(mix->buf);
+        free(mix->silence);
+        mix->buf = (int16_t *)malloc(mix->config.period_size * SAMPLE_SIZE_IN_BYTES_STEREO);
+        mix->silence = (int16_t *)calloc(mix->config.period_size, SAMPLE_SIZE_IN_BYTES_STEREO);
+        mix->buf_frames = mix->buf != NULL && mix->silence != NULL ?
+                mix->config.period_size : 0;
+        if (mix->buf_frames == 0)
+            return -ENOMEM;
+    }
+
+    start = monotonic_ns();
+    mix->pcm = pcm_open(mix->card, PCM_DEVICE, PCM_OUT | PCM_NORESTART | PCM_MONOTONIC,
+            &mix->config);
+    stats_record_open(&mix->stats, monotonic_ns() - start);
+    if (mix->pcm != NULL && !pcm_is_ready(mix->pcm)) {
+        ALOGE("%s : pcm_open failed: %s", __func__, pcm_get_error(mix->pcm));
+        pcm_close(mix->pcm);
+        mix->pcm = NULL;
+    }
+
+    return mix->pcm != NULL ? 0 : -ENODEV;
+}
+
+/* must be called with the mixer mutex locked, by the worker */
+static void out_mixer_close(struct out_mixer *mix)
+{
+    if (mix->pcm == NULL)
+        return;
+    pcm_close(mix->pcm);
+    mix->pcm = NULL;
+    mix->queued_ns = 0;
+    stats_add(&mix->stats.standbys, 1);
+}
+
+/* when the frames queued in a playback pcm run out, now if it isn't running */
+static int64_t pcm_drained_ns(struct pcm *pcm, unsigned int rate)
+{
+    unsigned int kernel_buffer_size = pcm_get_buffer_size(pcm);
+    unsigned int avail;
+    struct timespec ts;
+
+    if (pcm_get_htimestamp(pcm, &avail, &ts) != 0 || avail >= kernel_buffer_size)
+        return monotonic_ns();
+
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec +
+            frames_to_ns(kernel_buffer_size - avail, rate);
+}
+
+/*
+ * must be called with the mixer mutex locked. The worker closes pcm once what
+ * it queued played out, until then nobody else opens the card.
+ */
+static void out_mixer_retire(struct out_mixer *mix, struct pcm *pcm, unsigned int rate)
+{
+    if (mix->retired != NULL)
+        pcm_close(mix->retired);
+    mix->retired = pcm;
+    mix->retired_end_ns = pcm_drained_ns(pcm, rate);
+    pthread_cond_signal(&mix->cond);
+    /* writers waiting for room wait that much longer, see out_mixer_write() */
+    pthread_cond_broadcast(&mix->space_cond);
+}
+
+/* must be called with the mixer mutex locked, after a period was queued */
+static void out_mixer_snapshot(struct out_mixer *mix)
+{
+    unsigned int kernel_buffer_size = mix->config.period_size * mix->config.period_count;
+    unsigned int avail;
+    struct timespec ts;
+    unsigned int i;
+
+    if (pcm_get_htimestamp(mix->pcm, &avail, &ts) != 0 || avail > kernel_buffer_size)
+        return;
+
+    mix->queued_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    mix->queued = kernel_buffer_size - avail;
+    for (i = 0; i < mix->count; i++)
+        mix->streams[i]->mix_base = atomic_load_explicit(&mix->streams[i]->ring.tail,
+                memory_order_relaxed);
+}
+
+/* must be called with the mixer mutex locked */
+static void out_mixer_wait(struct out_mixer *mix, int64_t deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+
+    pthread_cond_timedwait(&mix->cond, &mix->lock, &ts);
+}
+
+static void *out_mixer_worker(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct out_mixer *mix = &adev->out_mixer;
+
+    setpriority(PRIO_PROCESS, gettid(), OUT_MIXER_NICE);
+
+    pthread_mutex_lock(&mix->lock);
+    while (!mix->thread_exit) {
+        struct pcm_config config;
+        size_t period;
+        size_t bytes;
+        unsigned int i;
+        int ret;
+
+        if (mix->retired != NULL) {
+            if (monotonic_ns() < mix->retired_end_ns) {
+                out_mixer_wait(mix, mix->retired_end_ns);
+                continue;
+            }
+            pcm_close(mix->retired);
+            mix->retired = NULL;
+            /* out_mixer_release() waits for the card */
+            pthread_cond_broadcast(&mix->space_cond);
+            continue;
+        }
+
+        if (mix->count == 0) {
+            if (mix->pcm != NULL && monotonic_ns() >= mix->idle_deadline_ns) {
+                out_mixer_retire(mix, mix->pcm, mix->config.rate);
+                mix->pcm = NULL;
+                mix->queued_ns = 0;
+                stats_add(&mix->stats.standbys, 1);
+                continue;
+            }
+            if (mix->pcm == NULL)
+                pthread_cond_wait(&mix->cond, &mix->lock);
+            else
+                out_mixer_wait(mix, mix->idle_deadline_ns);
+            continue;
+        }
+
+        if (mix->pcm == NULL && mix->card_busy) {
+            /* the lone output hands its pcm over on its next write, see out_write() */
+            pthread_cond_wait(&mix->cond, &mix->lock);
+            continue;
+        }
+
+        if (mix->pcm == NULL && out_mixer_open(mix) != 0) {
+            /* drop what was queued, the writers pace themselves until the card is back */
+            for (i = 0; i < mix->count; i++)
+                atomic_store_explicit(&mix->streams[i]->ring.tail,
+                        atomic_load_explicit(&mix->streams[i]->ring.head, memory_order_acquire),
+                        memory_order_release);
+            pthread_cond_broadcast(&mix->space_cond);
+            out_mixer_wait(mix, monotonic_ns() + OUT_MIXER_RETRY_MS * 1000000LL);
+            continue;
+        }
+
+        /* a stream with a shorter period came or the shortest left */
+        out_mixer_config(mix, &config);
+        if (config.period_size != mix->config.period_size) {
+            ALOGI("%s : period %u -> %u frames", __func__, mix->config.period_size,
+                    config.period_size);
+            out_mixer_retire(mix, mix->pcm, mix->config.rate);
+            mix->pcm = NULL;
+            mix->queued_ns = 0;
+            stats_add(&mix->stats.standbys, 1);
+            continue;
+        }
+        period = mix->config.period_size;
+        bytes = period * SAMPLE_SIZE_IN_BYTES_STEREO;
+
+        memset(mix->buf, 0, bytes);
+        for (i = 0; i < mix->count; i++) {
+            struct stream_out *out = mix->streams[i];
+            size_t frames = mix_ring_read_add(&out->ring, mix->buf, period);
+
+            /* a stream that was keeping up ran dry, the rest of the period is silence */
+            if (frames < period && out->mix_fed)
+                stats_add(&out->stats.xruns, 1);
+            out->mix_fed = frames == period;
+        }
+        pthread_cond_broadcast(&mix->space_cond);
+        pthread_mutex_unlock(&mix->lock);
+
+        ret = stats_pcm_write(&mix->stats, mix->pcm, mix->buf, bytes);
+        if (ret == -EPIPE) {
+            ALOGW("%s : underrun", __func__);
+            stats_add(&mix->stats.xruns, 1);
+            ret = recover_pcm_xrun(&mix->stats, mix->pcm,
+                    adev->xrun_prefill ? mix->silence : NULL, bytes, mix->buf, bytes);
+        }
+
+        pthread_mutex_lock(&mix->lock);
+        stats_add(&mix->stats.bytes, bytes);
+        stats_add(&mix->stats.frames, period);
+        if (ret != 0) {
+            ALOGE("%s : pcm_write failed: %s", __func__, pcm_get_error(mix->pcm));
+            out_mixer_close(mix);
+            continue;
+        }
+        out_mixer_snapshot(mix);
+    }
+    out_mixer_close(mix);
+    if (mix->retired != NULL)
+        pcm_close(mix->retired);
+    mix->retired = NULL;
+    pthread_mutex_unlock(&mix->lock);
+
+    return NULL;
+}
+
+static void start_out_mixer(struct audio_device *adev)
+{
+    struct out_mixer *mix = &adev->out_mixer;
+    pthread_condattr_t attr;
+
+    if (!property_get_bool(OUT_MIXER_PROPERTY, true))
+        return;
+
+    pthread_mutex_init(&mix->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mix->cond, &attr);
+    pthread_cond_init(&mix->space_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&mix->thread, NULL, out_mixer_worker, adev) != 0) {
+        ALOGE("%s : failed to start, every output opens the card", __func__);
+        pthread_cond_destroy(&mix->space_cond);
+        pthread_cond_destroy(&mix->cond);
+        pthread_mutex_destroy(&mix->lock);
+        return;
+    }
+    mix->thread_started = true;
+    ALOGI("%s : outputs share the card through the software mixer", __func__);
+}
+
+/* must be called without the hw device mutex, once no stream is left open */
+static void stop_out_mixer(struct audio_device *adev)
+{
+    struct out_mixer *mix = &adev->out_mixer;
+
+    if (!mix->thread_started)
+        return;
+
+    pthread_mutex_lock(&mix->lock);
+    mix->thread_exit = true;
+    pthread_cond_signal(&mix->cond);
+    pthread_mutex_unlock(&mix->lock);
+
+    pthread_join(mix->thread, NULL);
+    pthread_cond_destroy(&mix->space_cond);
+    pthread_cond_destroy(&mix->cond);
+    pthread_mutex_destroy(&mix->lock);
+    free(mix->buf);
+    free(mix->silence);
+    mix->buf = NULL;
+    mix->silence = NULL;
+    mix->buf_frames = 0;
+    mix->thread_started = false;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static int out_mixer_attach(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+    struct out_mixer *mix = &adev->out_mixer;
+
+    pthread_mutex_lock(&mix->lock);
+    if (mix->count == OUT_MIXER_MAX_STREAMS) {
+        pthread_mutex_unlock(&mix->lock);
+        return -EBUSY;
+    }
+    atomic_store_explicit(&out->ring.head, 0, memory_order_relaxed);
+    atomic_store_explicit(&out->ring.tail, 0, memory_order_relaxed);
+    out->mix_base = 0;
+    out->mix_fed = false;
+    out->mixed = true;
+    mix->card = adev->card;
+    mix->streams[mix->count++] = out;
+    pthread_cond_signal(&mix->cond);
+    pthread_mutex_unlock(&mix->lock);
+
+    return 0;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static void out_mixer_detach(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+    struct out_mixer *mix = &adev->out_mixer;
+    unsigned int i;
+
+    pthread_mutex_lock(&mix->lock);
+    for (i = 0; i < mix->count; i++) {
+        if (mix->streams[i] == out) {
+            mix->streams[i] = mix->streams[--mix->count];
+            break;
+        }
+    }
+    /* the pcm stays open for a while, like a warm output */
+    if (mix->count == 0)
+        mix->idle_deadline_ns = monotonic_ns() +
+                (int64_t)(adev->standby_delay_ms > 0 ? adev->standby_delay_ms : 0) * 1000000LL;
+    out->mixed = false;
+    pthread_cond_signal(&mix->cond);
+    pthread_mutex_unlock(&mix->lock);
+}
+
+/*
+ * must be called with hw device mutex locked, once no stream is attached.
+ * Closes the pcm the mixer keeps warm so that a lone output can open the card,
+ * after what it queued played out.
+ */
+static void out_mixer_release(struct audio_device *adev)
+{
+    struct out_mixer *mix = &adev->out_mixer;
+
+    if (!mix->thread_started)
+        return;
+
+    pthread_mutex_lock(&mix->lock);
+    mix->idle_deadline_ns = 0;
+    pthread_cond_signal(&mix->cond);
+    while (mix->count == 0 && (mix->pcm != NULL || mix->retired != NULL))
+        pthread_cond_wait(&mix->space_cond, &mix->lock);
+    pthread_mutex_unlock(&mix->lock);
+}
+
+/*
+ * must be called with hw device mutex locked, after out_direct or out_mmap
+ * changed. The worker doesn't try the card while one of them has it.
+ */
+static void update_mixer_card(struct audio_device *adev)
+{
+    struct out_mixer *mix = &adev->out_mixer;
+
+    if (!mix->thread_started)
+        return;
+
+    pthread_mutex_lock(&mix->lock);
+    mix->card_busy = adev->out_direct != NULL || adev->out_mmap != NULL;
+    pthread_cond_signal(&mix->cond);
+    pthread_mutex_unlock(&mix->lock);
+}
+
+/*
+ * must be called with hw device and output stream mutexes locked, when the
+ * lone output moves onto the mixer. Its pcm goes to the worker, which lets it
+ * play out what it queued before opening the card for the mix.
+ */
+static void out_mixer_hand_over(struct stream_out *out)
+{
+    struct out_mixer *mix = &out->dev->out_mixer;
+
+    pthread_mutex_lock(&mix->lock);
+    out_mixer_retire(mix, out->pcm, out->pcm_config->rate);
+    pthread_mutex_unlock(&mix->lock);
+    out->pcm = NULL;
+}
+
+/*
+ * must be called with output stream mutex locked, before a mixed output
+ * leaves the mixer for the card. Waits for the worker to take what is left
+ * in the ring.
+ */
+static void out_mixer_drain(struct stream_out *out)
+{
+    struct out_mixer *mix = &out->dev->out_mixer;
+    struct mix_ring *ring = &out->ring;
+    int64_t deadline_ns = monotonic_ns() + frames_to_ns(ring->frames, pcm_config_out_mixer.rate) +
+            OUT_MIXER_RETRY_MS * 1000000LL;
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+    uint64_t left;
+    int ret = 0;
+
+    pthread_mutex_lock(&mix->lock);
+    while (ret == 0 && atomic_load_explicit(&ring->head, memory_order_relaxed) !=
+            atomic_load_explicit(&ring->tail, memory_order_acquire))
+        ret = pthread_cond_timedwait(&mix->space_cond, &mix->lock, &ts);
+    left = atomic_load_explicit(&ring->head, memory_order_relaxed) -
+            atomic_load_explicit(&ring->tail, memory_order_acquire);
+    pthread_mutex_unlock(&mix->lock);
+
+    if (left != 0)
+        ALOGW("%s : mixer stalled, %" PRIu64 " frames dropped", __func__, left);
+}
+
+/*
+ * must be called with hw device mutex locked, after an output that can be
+ * mixed started or stopped. One playing output has the card to itself with
+ * its own profile, the mixer and its added latency only come in while several
+ * play. Outputs on the wrong side are flagged and move on their next write.
+ */
+static void update_out_sharing(struct audio_device *adev)
+{
+    struct out_mixer *mix = &adev->out_mixer;
+    bool shared = adev->outs_playing > 1;
+    unsigned int i;
+
+    if (adev->out_direct != NULL && !adev->out_direct->standby)
+        atomic_store_explicit(&adev->out_direct->mix_move, shared, memory_order_relaxed);
+
+    if (!mix->thread_started)
+        return;
+
+    pthread_mutex_lock(&mix->lock);
+    for (i = 0; i < mix->count; i++)
+        atomic_store_explicit(&mix->streams[i]->mix_move, !shared, memory_order_relaxed);
+    pthread_mutex_unlock(&mix->lock);
+}
+
+/*
+ * must be called with output stream mutex locked. Queues frames for the mixer,
+ * waiting for room while the ring is full. Fails with -ETIMEDOUT when the
+ * mixer stopped taking frames, out_write() then paces the buffer itself.
+ */
+static int out_mixer_write(struct stream_out *out, const int16_t *buffer, size_t frames)
+{
+    struct out_mixer *mix = &out->dev->out_mixer;
+    struct mix_ring *ring = &out->ring;
+    size_t done = 0;
+
+    for (;;) {
+        int64_t wait_ns = frames_to_ns(ring->frames, pcm_config_out_mixer.rate) +
+                OUT_MIXER_RETRY_MS * 1000000LL;
+        int64_t start_ns;
+        int ret = 0;
+
+        done += mix_ring_write(ring, buffer + 2 * done, frames - done);
+        if (done == frames)
+            return 0;
+
+        start_ns = monotonic_ns();
+        pthread_mutex_lock(&mix->lock);
+        while (ret == 0 && atomic_load_explicit(&ring->head, memory_order_relaxed) -
+                atomic_load_explicit(&ring->tail, memory_order_acquire) == ring->frames) {
+            int64_t deadline_ns = start_ns + wait_ns;
+            struct timespec ts;
+
+            /* nothing is taken while the card plays out its previous owner's queue */
+            if (mix->retired != NULL && mix->retired_end_ns + wait_ns > deadline_ns)
+                deadline_ns = mix->retired_end_ns + wait_ns;
+            ts.tv_sec = deadline_ns / 1000000000LL;
+            ts.tv_nsec = deadline_ns % 1000000000LL;
+            ret = pthread_cond_timedwait(&mix->space_cond, &mix->lock, &ts);
+        }
+        pthread_mutex_unlock(&mix->lock);
+
+        if (ret != 0) {
+            ALOGW("%s : mixer stalled", __func__);
+            return -ETIMEDOUT;
+        }
+    }
+}
+
+/*
+ * must be called with output stream mutex locked. Card frames written but not
+ * played yet: what is left in the ring plus what the mixer had queued in the
+ * pcm at the time returned in timestamp.
+ */
+static int out_mixer_queued(struct stream_out *out, uint64_t *queued, struct timespec *timestamp)
+{
+    struct out_mixer *mix = &out->dev->out_mixer;
+    int ret = -ENODATA;
+
+    pthread_mutex_lock(&mix->lock);
+    if (mix->queued_ns != 0) {
+        *queued = atomic_load_explicit(&out->ring.head, memory_order_relaxed) -
+                out->mix_base + mix->queued;
+        timestamp->tv_sec = mix->queued_ns / 1000000000LL;
+        timestamp->tv_nsec = mix->queued_ns % 1000000000LL;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&mix->lock);
+
+    return ret;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static void do_out_standby(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+    if (!out->standby || out->warm) {
+        bool sharing = !out->standby && (out->mixed || out == adev->out_direct);
+
+        if (out->warm)
+            unlink_warm_output(out);
+        else
+            stats_add(&out->stats.standbys, 1);
+        if (out->mixed)
+            out_mixer_detach(out);
+        else if (out->pcm != NULL) /* NULL once handed to the mixer */
+            pcm_close(out->pcm);
+        out->pcm = NULL;
+        if (adev->active_out == out)
+            adev->active_out = NULL;
+        if (adev->out_direct == out || adev->out_mmap == out) {
+            if (adev->out_direct == out)
+                adev->out_direct = NULL;
+            else
+                adev->out_mmap = NULL;
+            update_mixer_card(adev);
+        }
+        if (adev->sco_out == out)
+            adev->sco_out = NULL;
+        out->standby = true;
+        if (sharing) {
+            adev->outs_playing--;
+            update_out_sharing(adev);
+        }
+    }
+}
+
+/*
+ * must be called with hw device and output stream mutexes locked. Stops the
+ * pcm but leaves it open for standby_delay_ms so that a write arriving within
+ * that window restarts it without pcm_open() and hw_params. standby_worker()
+ * closes it once the delay runs out.
+ */
+static void do_out_standby_delayed(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    if (out->standby)
+        return;
+
+    /* the mixer keeps its own pcm warm, the BT pcm goes back with the call */
+    if (!adev->standby_thread_started || adev->standby_delay_ms <= 0 ||
+            (out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) || out->mixed ||
+            adev->sco_out == out) {
+        do_out_standby(out);
+        return;
+    }
+
+    pcm_stop(out->pcm);
+    if (adev->active_out == out)
+        adev->active_out = NULL;
+    stats_add(&out->stats.standbys, 1);
+    out->standby = true;
+    if (adev->out_direct == out) {
+        /* keeps the card, the next output to start closes it */
+        adev->outs_playing--;
+        update_out_sharing(adev);
+    }
+    out->warm = true;
+    out->warm_deadline_ns = monotonic_ns() + (int64_t)adev->standby_delay_ms * 1000000LL;
+    out->warm_next = adev->warm_outs;
+    adev->warm_outs = out;
+    pthread_cond_signal(&adev->standby_cond);
+}
+
+static void *standby_worker(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+
+    pthread_mutex_lock(&adev->lock);
+    while (!adev->standby_thread_exit) {
+        int64_t now = monotonic_ns();
+        int64_t next = INT64_MAX;
+        struct stream_out *out = adev->warm_outs;
+
+        while (out != NULL) {
+            struct stream_out *next_out = out->warm_next;
+
+            if (out->warm_deadline_ns <= now) {
+                ALOGV("%s : closing idle output %p", __func__, out);
+                pthread_mutex_lock(&out->lock);
+                do_out_standby(out);
+                pthread_mutex_unlock(&out->lock);
+            } else if (out->warm_deadline_ns < next) {
+                next = out->warm_deadline_ns;
+            }
+            out = next_out;
+        }
+
+        if (next == INT64_MAX) {
+            pthread_cond_wait(&adev->standby_cond, &adev->lock);
+        } else {
+            struct timespec ts = {
+                .tv_sec = next / 1000000000LL,
+                .tv_nsec = next % 1000000000LL,
+            };
+            pthread_cond_timedwait(&adev->standby_cond, &adev->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&adev->lock);
+
+    return NULL;
+}
+
+static void start_standby_worker(struct audio_device *adev)
+{
+    pthread_condattr_t attr;
+
+    adev->standby_delay_ms = property_get_int32(OUT_STANDBY_DELAY_PROPERTY,
+            OUT_STANDBY_DELAY_MS_DEFAULT);
+    if (adev->standby_delay_ms <= 0)
+        return;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->standby_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&adev->standby_thread, NULL, standby_worker, adev) != 0) {
+        ALOGE("%s : failed to start, outputs close on standby", __func__);
+        pthread_cond_destroy(&adev->standby_cond);
+        return;
+    }
+    adev->standby_thread_started = true;
+    ALOGI("%s : outputs stay open %d ms after standby", __func__, adev->standby_delay_ms);
+}
+
+/* must be called without the hw device mutex, once no stream is left open */
+static void stop_standby_worker(struct audio_device *adev)
+{
+    if (!adev->standby_thread_started)
+        return;
+
+    pthread_mutex_lock(&adev->lock);
+    adev->standby_thread_exit = true;
+    pthread_cond_signal(&adev->standby_cond);
+    pthread_mutex_unlock(&adev->lock);
+
+    pthread_join(adev->standby_thread, NULL);
+    pthread_cond_destroy(&adev->standby_cond);
+    adev->standby_thread_started = false;
+}
+
+/*
+ * must be called with hw device mutex locked. Moves the devices the jacks
+ * decide between onto what is plugged in, so playback and capture follow a
+ * headset before the framework hears of it. The framework's own routing
+ * still overrides this on its next set_parameters. Calls and devices the jacks
+ * do not decide between (earpiece, BT) are left alone, the framework moves
+ * those itself.
+ */
+static void jack_apply(struct audio_device *adev, unsigned int jack_out, unsigned int jack_in)
+{
+    unsigned int wired_out = AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
+    unsigned int headset_mic = AUDIO_DEVICE_IN_WIRED_HEADSET & ~AUDIO_DEVICE_BIT_IN;
+    unsigned int builtin_mic = AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN;
+
+    if (adev->is_hfp_call_active || adev->in_sco_voip_call) {
+        ALOGD("%s : call owns routing, jacks out %#x in %#x not applied", __func__,
+                jack_out, jack_in);
+        return;
+    }
+
+    if ((adev->out_device & ~(wired_out | AUDIO_DEVICE_OUT_SPEAKER)) == 0) {
+        if (jack_out != 0)
+            adev->out_device = jack_out;
+        else if (adev->out_device & wired_out)
+            adev->out_device = AUDIO_DEVICE_OUT_SPEAKER;
+    }
+
+    if ((adev->in_device & ~(headset_mic | builtin_mic | AUDIO_DEVICE_BIT_IN)) == 0) {
+        if (jack_in != 0)
+            adev->in_device = headset_mic;
+        else if (adev->in_device & headset_mic)
+            adev->in_device = builtin_mic;
+    }
+
+    select_devices(adev);
+}
+
+static void jack_read(struct audio_device *adev, unsigned int *jack_out, unsigned int *jack_in)
+{
+    bool headphone = adev->headphone_jack_ctl != NULL &&
+            mixer_ctl_get_value(adev->headphone_jack_ctl, 0) > 0;
+    bool mic = adev->headset_mic_jack_ctl != NULL &&
+            mixer_ctl_get_value(adev->headset_mic_jack_ctl, 0) > 0;
+
+    *jack_out = !headphone ? 0 :
+            mic ? AUDIO_DEVICE_OUT_WIRED_HEADSET : AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
+    *jack_in = mic ? AUDIO_DEVICE_IN_WIRED_HEADSET & ~AUDIO_DEVICE_BIT_IN : 0;
+}
+
+/*
+ * Sleeps on the jack kcontrols and reroutes as soon as one flips, instead of
+ * waiting for the framework's round trip through set_parameters.
+ */
+static void *jack_worker(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    unsigned int jack_out = 0;
+    unsigned int jack_in = 0;
+    bool first = true;
+
+    while (!atomic_load(&adev->jack_thread_exit)) {
+        unsigned int out, in;
+        int64_t start;
+        int ret;
+
+        if (!first) {
+            ret = mixer_wait_event(adev->jack_mixer, JACK_WAIT_MS);
+            if (ret == 0)
+                continue;
+            if (ret < 0) {
+                ALOGE("%s : mixer_wait_event failed: %d", __func__, ret);
+                usleep(JACK_WAIT_MS * 1000);
+                continue;
+            }
+            /* one event per wakeup, the ctls are read back whole below */
+            mixer_consume_event(adev->jack_mixer);
+        }
+
+        jack_read(adev, &out, &in);
+        if (!first && out == jack_out && in == jack_in)
+            continue;
+
+        start = monotonic_ns();
+        pthread_mutex_lock(&adev->lock);
+        jack_apply(adev, out, in);
+        pthread_mutex_unlock(&adev->lock);
+        atomic_store(&adev->jack_out, out);
+        atomic_store(&adev->jack_in, in);
+
+        ALOGI("%s : jacks out %#x in %#x, routed in %" PRId64 " us", __func__, out, in,
+                (monotonic_ns() - start) / 1000);
+        jack_out = out;
+        jack_in = in;
+        first = false;
+    }
+
+    return NULL;
+}
+
+static void start_jack_worker(struct audio_device *adev)
+{
+    char ctl_name[PROPERTY_VALUE_MAX];
+
+    if (!property_get_bool(JACK_EVENTS_PROPERTY, true))
+        return;
+
+    adev->jack_mixer = mixer_open(adev->cards.mixer_card);
+    if (adev->jack_mixer == NULL) {
+        ALOGE("%s : no mixer on card %d, routing follows the framework only", __func__,
+                adev->cards.mixer_card);
+        return;
+    }
+
+    property_get(JACK_HEADPHONE_CTL_PROPERTY, ctl_name, JACK_HEADPHONE_CTL_DEFAULT);
+    adev->headphone_jack_ctl = mixer_get_ctl_by_name(adev->jack_mixer, ctl_name);
+    property_get(JACK_HEADSET_MIC_CTL_PROPERTY, ctl_name, JACK_HEADSET_MIC_CTL_DEFAULT);
+    adev->headset_mic_jack_ctl = mixer_get_ctl_by_name(adev->jack_mixer, ctl_name);
+    if (adev->headphone_jack_ctl == NULL && adev->headset_mic_jack_ctl == NULL) {
+        ALOGI("%s : card %d has no jack controls", __func__, adev->cards.mixer_card);
+        goto error;
+    }
+
+    if (mixer_subscribe_events(adev->jack_mixer, 1) != 0) {
+        ALOGE("%s : mixer_subscribe_events failed", __func__);
+        goto error;
+    }
+
+    atomic_init(&adev->jack_thread_exit, false);
+    if (pthread_create(&adev->jack_thread, NULL, jack_worker, adev) != 0) {
+        ALOGE("%s : failed to start, routing follows the framework only", __func__);
+        mixer_subscribe_events(adev->jack_mixer, 0);
+        goto error;
+    }
+    adev->jack_thread_started = true;
+    ALOGI("%s : following jacks, headphone %s, headset mic %s", __func__,
+            adev->headphone_jack_ctl != NULL ? "yes" : "no",
+            adev->headset_mic_jack_ctl != NULL ? "yes" : "no");
+    return;
+
+error:
+    mixer_close(adev->jack_mixer);
+    adev->jack_mixer = NULL;
+    adev->headphone_jack_ctl = NULL;
+    adev->headset_mic_jack_ctl = NULL;
+}
+
+/* must be called without the hw device mutex */
+static void stop_jack_worker(struct audio_device *adev)
+{
+    if (!adev->jack_thread_started)
+        return;
+
+    atomic_store(&adev->jack_thread_exit, true);
+    pthread_join(adev->jack_thread, NULL);
+    adev->jack_thread_started = false;
+
+    mixer_subscribe_events(adev->jack_mixer, 0);
+    mixer_close(adev->jack_mixer);
+    adev->jack_mixer = NULL;
+}
+
+/* must be called with the hub mutex locked */
+static void in_hub_wait(struct in_hub *hub, int64_t deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+
+    pthread_cond_timedwait(&hub->cond, &hub->lock, &ts);
+}
+
+/* must be called with the hub mutex locked, by the worker */
+static int in_hub_open(struct in_hub *hub)
+{
+    int64_t start = monotonic_ns();
+
+    hub->pcm = pcm_open(hub->card, PCM_DEVICE, PCM_IN | PCM_MONOTONIC, &pcm_config_in);
+    stats_record_open(&hub->stats, monotonic_ns() - start);
+    if (hub->pcm != NULL && !pcm_is_ready(hub->pcm)) {
+        ALOGE("%s : pcm_open failed: %s", __func__, pcm_get_error(hub->pcm));
+        pcm_close(hub->pcm);
+        hub->pcm = NULL;
+    }
+    hub->opened = atomic_load_explicit(&hub->head, memory_order_relaxed);
+
+    return hub->pcm != NULL ? 0 : -ENODEV;
+}
+
+/* must be called with the hub mutex locked, by the worker */
+static void in_hub_close(struct in_hub *hub)
+{
+    if (hub->pcm == NULL)
+        return;
+    pcm_close(hub->pcm);
+    hub->pcm = NULL;
+    hub->captured_ns = 0;
+    stats_add(&hub->stats.standbys, 1);
+}
+
+static void *in_hub_worker(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct in_hub *hub = &adev->in_hub;
+    size_t period = pcm_config_in.period_size;
+    size_t bytes = period * pcm_config_in.channels * SAMPLE_SIZE_IN_BYTES;
+    int nice = 0;
+
+    pthread_mutex_lock(&hub->lock);
+    while (!hub->thread_exit) {
+        unsigned int calls = CTL_HFP_CALL_ACTIVE | CTL_SCO_VOIP_CALL;
+        uint64_t head;
+        unsigned int avail;
+        struct timespec ts;
+        int ret;
+
+        if (hub->count == 0 && hub->preroll_ms == 0) {
+            /* nobody listens, don't keep the mic open */
+            in_hub_close(hub);
+            pthread_cond_wait(&hub->cond, &hub->lock);
+            continue;
+        }
+        if (hub->count == 0 &&
+                (atomic_load_explicit(&adev->ctl_state, memory_order_relaxed) & calls)) {
+            /* the call owns the mic, pre-roll resumes after it */
+            in_hub_close(hub);
+            in_hub_wait(hub, monotonic_ns() + IN_HUB_RETRY_MS * 1000000LL);
+            continue;
+        }
+        if (nice != (hub->count != 0 ? IN_HUB_NICE : IN_PREROLL_NICE)) {
+            nice = hub->count != 0 ? IN_HUB_NICE : IN_PREROLL_NICE;
+            setpriority(PRIO_PROCESS, gettid(), nice);
+        }
+
+        if (hub->pcm == NULL && in_hub_open(hub) != 0) {
+            /* the readers time out and pace themselves until the card is back */
+            in_hub_wait(hub, monotonic_ns() + IN_HUB_RETRY_MS * 1000000LL);
+            continue;
+        }
+        pthread_mutex_unlock(&hub->lock);
+
+        /*
+         * straight into the ring: the period being read overwrites the oldest
+         * one, readers that were still copying it notice in in_hub_read()
+         */
+        head = atomic_load_explicit(&hub->head, memory_order_relaxed);
+        ret = stats_pcm_read(&hub->stats, hub->pcm,
+                hub->data + (head % hub->frames) * pcm_config_in.channels, bytes);
+
+        pthread_mutex_lock(&hub->lock);
+        if (ret != 0) {
+            ALOGE("%s : pcm_read failed: %s", __func__, pcm_get_error(hub->pcm));
+            in_hub_close(hub);
+            in_hub_wait(hub, monotonic_ns() + IN_HUB_RETRY_MS * 1000000LL);
+            continue;
+        }
+        atomic_store_explicit(&hub->head, head + period, memory_order_release);
+        stats_add(&hub->stats.bytes, bytes);
+        stats_add(&hub->stats.frames, period);
+        if (pcm_get_htimestamp(hub->pcm, &avail, &ts) == 0) {
+            hub->captured_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            hub->captured = head + period + avail;
+        }
+        pthread_cond_broadcast(&hub->data_cond);
+    }
+    in_hub_close(hub);
+    pthread_mutex_unlock(&hub->lock);
+
+    return NULL;
+}
+
+static void start_in_hub(struct audio_device *adev)
+{
+    struct in_hub *hub = &adev->in_hub;
+    pthread_condattr_t attr;
+    int preroll_ms = property_get_int32(IN_PREROLL_PROPERTY, 0);
+    size_t period = pcm_config_in.period_size;
+    size_t history;
+
+    if (!property_get_bool(IN_HUB_PROPERTY, true)) {
+        if (preroll_ms > 0)
+            ALOGW("%s : pre-roll needs the capture hub", __func__);
+        return;
+    }
+
+    if (preroll_ms > IN_PREROLL_MS_MAX)
+        preroll_ms = IN_PREROLL_MS_MAX;
+    hub->preroll_ms = preroll_ms > 0 ? preroll_ms : 0;
+    hub->card = adev->cards.card_in;
+
+    /* the history plus the period being captured and one being read */
+    history = ((size_t)hub->preroll_ms * pcm_config_in.rate / 1000 + period - 1) / period;
+    hub->frames = period * (history + 2 > IN_HUB_PERIODS ? history + 2 : IN_HUB_PERIODS);
+    hub->data = (int16_t *)calloc(hub->frames, pcm_config_in.channels * SAMPLE_SIZE_IN_BYTES);
+    if (hub->data == NULL)
+        return;
+    atomic_init(&hub->head, 0);
+
+    pthread_mutex_init(&hub->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hub->cond, &attr);
+    pthread_cond_init(&hub->data_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&hub->thread, NULL, in_hub_worker, adev) != 0) {
+        ALOGE("%s : failed to start, every input opens the card", __func__);
+        pthread_cond_destroy(&hub->data_cond);
+        pthread_cond_destroy(&hub->cond);
+        pthread_mutex_destroy(&hub->lock);
+        free(hub->data);
+        hub->data = NULL;
+        return;
+    }
+    hub->thread_started = true;
+    ALOGI("%s : inputs share the card through the capture hub, pre-roll %u ms", __func__,
+            hub->preroll_ms);
+
+    if (hub->preroll_ms != 0) {
+        /* the mic path must be up before anybody records */
+        pthread_mutex_lock(&adev->lock);
+        select_devices(adev);
+        pthread_mutex_unlock(&adev->lock);
+    }
+}
+
+/* must be called without the hw device mutex, once no stream is left open */
+static void stop_in_hub(struct audio_device *adev)
+{
+    struct in_hub *hub = &adev->in_hub;
+
+    if (!hub->thread_started)
+        return;
+
+    pthread_mutex_lock(&hub->lock);
+    hub->thread_exit = true;
+    pthread_cond_signal(&hub->cond);
+    pthread_mutex_unlock(&hub->lock);
+
+    pthread_join(hub->thread, NULL);
+    pthread_cond_destroy(&hub->data_cond);
+    pthread_cond_destroy(&hub->cond);
+    pthread_mutex_destroy(&hub->lock);
+    free(hub->data);
+    hub->data = NULL;
+    hub->thread_started = false;
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static int in_hub_attach(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    struct in_hub *hub = &adev->in_hub;
+
+    pthread_mutex_lock(&hub->lock);
+    if (hub->count == IN_HUB_MAX_STREAMS) {
+        pthread_mutex_unlock(&hub->lock);
+        return -EBUSY;
+    }
+    /* from what is captured next, or as far back into the pre-roll as asked */
+    in->hub_pos = atomic_load_explicit(&hub->head, memory_order_relaxed);
+    if (in->preroll_ms != 0 && hub->pcm != NULL) {
+        uint64_t history = (uint64_t)in->preroll_ms * pcm_config_in.rate / 1000;
+
+        if (history > hub->frames - 2 * pcm_config_in.period_size)
+            history = hub->frames - 2 * pcm_config_in.period_size;
+        if (history > in->hub_pos - hub->opened)
+            history = in->hub_pos - hub->opened;
+        in->hub_pos -= history;
+    }
+    in->hubbed = true;
+    hub->card = adev->cards.card_in;
+    hub->streams[hub->count++] = in;
+    pthread_cond_signal(&hub->cond);
+    pthread_mutex_unlock(&hub->lock);
+
+    return 0;
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static void in_hub_detach(struct stream_in *in)
+{
+    struct in_hub *hub = &in->dev->in_hub;
+    unsigned int i;
+
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < hub->count; i++) {
+        if (hub->streams[i] == in) {
+            hub->streams[i] = hub->streams[--hub->count];
+            break;
+        }
+    }
+    in->hubbed = false;
+    pthread_cond_signal(&hub->cond);
+    pthread_mutex_unlock(&hub->lock);
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static void do_in_standby(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    if (!in->standby) {
+        stats_add(&in->stats.standbys, 1);
+        if (in->hubbed)
+            in_hub_detach(in);
+        else
+            pcm_close(in->pcm);
+        in->pcm = NULL;
+        if (adev->active_in == in)
+            adev->active_in = NULL;
+        if (adev->sco_in == in)
+            adev->sco_in = NULL;
+        in->standby = true;
+        in->hw_frames = 0;
+        in->last_capture_ns = 0;
+    }
+}
+
+static const char * const primary_card_names[] = { "PCH", "Intel", "sofhdadsp", "Dummy" };
+
+static int find_primary_card(struct card_registry *registry)
+{
+    int card = -1;
+    size_t i;
+
+    for (i = 0; i < sizeof(primary_card_names) / sizeof(primary_card_names[0]) && card == -1; i++)
+        card = card_registry_find(registry, primary_card_names[i]);
+
+    return card;
+}
+
+/* first card of the chain, falling back to Dummy when it can't report params */
+static int probe_pcm_card(struct card_registry *registry, unsigned int flags,
+                          struct pcm_params **params)
+{
+    int card = find_primary_card(registry);
+
+    *params = NULL;
+    if (card != -1)
+        *params = pcm_params_get(card, PCM_DEVICE, flags);
+
+    if (!*params) {
+        card = card_registry_find(registry, "Dummy");
+        if (card != -1)
+            *params = pcm_params_get(card, PCM_DEVICE, flags);
+    }
+
+    return card;
+}
+
+static void primary_cards_clear(struct primary_cards *cards)
+{
+    if (cards->params_out)
+        pcm_params_free(cards->params_out);
+    if (cards->params_in)
+        pcm_params_free(cards->params_in);
+    cards->params_out = NULL;
+    cards->params_in = NULL;
+    cards->valid = false;
+}
+
+static void primary_cards_init(struct primary_cards *cards)
+{
+    memset(cards, 0, sizeof(*cards));
+    card_registry_init(&cards->registry);
+}
+
+static void primary_cards_release(struct primary_cards *cards)
+{
+    primary_cards_clear(cards);
+    card_registry_release(&cards->registry);
+}
+
+/*
+ * must be called with hw device mutex locked. Re-probes only when a card was
+ * added or removed since the last call, or when the last probe failed.
+ */
+static void primary_cards_sync(struct primary_cards *cards)
+{
+    uint32_t generation = card_registry_sync(&cards->registry);
+
+    if (cards->valid && cards->generation == generation)
+        return;
+
+    primary_cards_clear(cards);
+    cards->generation = generation;
+    cards->mixer_card = find_primary_card(&cards->registry);
+    cards->card_out = probe_pcm_card(&cards->registry, PCM_OUT, &cards->params_out);
+    cards->card_in = probe_pcm_card(&cards->registry, PCM_IN, &cards->params_in);
+    cards->bt_card = card_registry_find(&cards->registry, AUDIO_BT_DRIVER_NAME); //update driver name if changed from BT side.
+    cards->valid = cards->params_out != NULL && cards->params_in != NULL;
+
+    ALOGI("%s : cards [mixer %d : out %d : in %d : bt %d]", __func__,
+            cards->mixer_card, cards->card_out, cards->card_in, cards->bt_card);
+}
+
+/* must be called with hw device mutex locked */
+void update_bt_card(struct audio_device *adev){
+    primary_cards_sync(&adev->cards);
+    adev->bt_card = adev->cards.bt_card;
+}
+
+static unsigned int round_to_16_mult(unsigned int size)
+{
+    return (size + 15) & ~15;   /* 0xFFFFFFF0; */
+}
+
+/*
+ * AUDIO_OUTPUT_FLAG_DEEP_BUFFER: OUT_DEEP_PERIOD_MS periods, clamped to what
+ * the card reports, so the writer and the DMA wake up as rarely as possible.
+ */
+static void init_deep_buffer_config(struct pcm_config *config, struct pcm_params *params)
+{
+    unsigned int period_size = OUT_SAMPLING_RATE * OUT_DEEP_PERIOD_MS / 1000;
+    unsigned int period_count = OUT_DEEP_PERIOD_COUNT;
+    unsigned int min_size = pcm_params_get_min(params, PCM_PARAM_PERIOD_SIZE);
+    unsigned int max_size = pcm_params_get_max(params, PCM_PARAM_PERIOD_SIZE);
+    unsigned int min_count = pcm_params_get_min(params, PCM_PARAM_PERIODS);
+    unsigned int max_count = pcm_params_get_max(params, PCM_PARAM_PERIODS);
+    unsigned int max_buffer = pcm_params_get_max(params, PCM_PARAM_BUFFER_SIZE);
+
+    if (max_size != 0 && period_size > max_size)
+        period_size = max_size;
+    if (period_size < min_size)
+        period_size = min_size;
+
+    if (max_count != 0 && period_count > max_count)
+        period_count = max_count;
+    if (period_count < min_count)
+        period_count = min_count;
+    if (period_count < 2)
+        period_count = 2;
+
+    /* the ring must fit in the card buffer, give up period size before count */
+    if (max_buffer != 0 && period_size * period_count > max_buffer) {
+        period_size = max_buffer / period_count;
+        if (period_size < min_size) {
+            period_size = min_size;
+            period_count = max_buffer / period_size;
+        }
+        /* ALSA needs two periods to double buffer, the buffer limit wins over min_size */
+        if (period_count < 2) {
+            period_count = 2;
+            period_size = max_buffer / period_count;
+        }
+    }
+
+    /* keep periods a multiple of 16 frames, as for the other profiles */
+    if ((period_size & ~15) != 0 && (period_size & ~15) >= min_size)
+        period_size &= ~15;
+
+    memcpy(config, &pcm_config_out, sizeof(*config));
+    config->period_size = period_size;
+    config->period_count = period_count;
+    config->start_threshold = period_size;
+    config->avail_min = period_size;
+
+    ALOGI("%s : deep buffer [period %u : count %u] from card limits [%u-%u : %u-%u : %u]", __func__,
+            period_size, period_count, min_size, max_size, min_count, max_count, max_buffer);
+}
+
+//[BT SCO VoIP Call
+static int sco_scratch_alloc(struct sco_scratch *scratch, size_t size_in, size_t size_out)
+{
+    size_t total = size_in + size_out;
+    char *base;
+
+    if (scratch->base != NULL)
+        return 0;
+
+    base = (char *)malloc(total);
+    if (base == NULL)
+        return -ENOMEM;
+
+    /* touch every page now rather than on the first call buffer */
+    memset(base, 0, total);
+
+    scratch->base = base;
+    scratch->buf_in = (int16_t *)base;
+    scratch->buf_out = (int16_t *)(base + size_in);
+    scratch->size_in = size_in;
+    scratch->size_out = size_out;
+
+    return 0;
+}
+
+static void sco_scratch_free(struct sco_scratch *scratch)
+{
+    free(scratch->base);
+    memset(scratch, 0, sizeof(*scratch));
+}
+
+/*
+ * must be called with hw device mutex locked. Sized for a pcm_config_out
+ * period; out_write() never hands the downlink more than that at once.
+ */
+static int alloc_sco_resources(struct audio_device *adev)
+{
+    size_t out_frames_in = round_to_16_mult(pcm_config_out.period_size);
+    size_t in_frames_in = round_to_16_mult(bt_in_config.period_size);
+    int ret;
+
+    fir_kernels_init();
+
+    if (pcm_config_in.rate != bt_in_config.rate * SCO_RESAMPLE_RATIO ||
+            pcm_config_out.channels != 2 || pcm_config_in.channels != 2 ||
+            bt_out_config.channels != 1 || bt_in_config.channels != 1) {
+        ALOGE("%s : unsupported sco conversion", __func__);
+        return -EINVAL;
+    }
+
+    if (bt_out_config.period_size > ECHO_REF_BLOCK_FRAMES) {
+        ALOGE("%s : downlink period does not fit an echo reference block", __func__);
+        return -EINVAL;
+    }
+
+    /* downlink output goes to the echo reference ring */
+    ret = sco_scratch_alloc(&adev->sco_out_scratch,
+            (SCO_FIR_TAPS - 1 + out_frames_in) * SAMPLE_SIZE_IN_BYTES_STEREO, 0);
+    if (ret == 0)
+        ret = sco_scratch_alloc(&adev->sco_in_scratch,
+                (SCO_FIR_PHASE_TAPS - 1 + in_frames_in) * SAMPLE_SIZE_IN_BYTES,
+                in_frames_in * SCO_RESAMPLE_RATIO * SAMPLE_SIZE_IN_BYTES_STEREO);
+
+    if (ret != 0) {
+        ALOGE("%s : failed to allocate sco scratch buffers", __func__);
+        return ret;
+    }
+
+    sco_downlink_init(&adev->voip_downlink, adev->sco_out_scratch.buf_in,
+            adev->sco_out_scratch.size_in / SAMPLE_SIZE_IN_BYTES_STEREO);
+    adev->sco_out_fill = 0;
+    sco_uplink_init(&adev->voip_uplink, adev->sco_in_scratch.buf_in,
+            adev->sco_in_scratch.size_in / SAMPLE_SIZE_IN_BYTES);
+
+    ALOGD("%s : out [%zu %zu] in [%zu %zu]", __func__,
+            adev->sco_out_scratch.size_in, adev->sco_out_scratch.size_out,
+            adev->sco_in_scratch.size_in, adev->sco_in_scratch.size_out);
+
+    return 0;
+}
+
+/*
+ * must be called with hw device mutex locked. The streams on the BT pcms are
+ * locked as well so that a write or read in progress never sees its buffers
+ * go away; no other stream touches them, see out_write() and in_read().
+ */
+static void release_sco_resources(struct audio_device *adev)
+{
+    struct stream_out *out = adev->sco_out;
+    struct stream_in *in = adev->sco_in;
+
+    /* prepared pcms no stream took, and any the worker is opening */
+    adev->sco_prep_pending = false;
+    adev->sco_prep_gen++;
+    if (adev->sco_pcm_out != NULL)
+        pcm_close(adev->sco_pcm_out);
+    if (adev->sco_pcm_in != NULL)
+        pcm_close(adev->sco_pcm_in);
+    adev->sco_pcm_out = NULL;
+    adev->sco_pcm_in = NULL;
+
+    if (out != NULL)
+        pthread_mutex_lock(&out->lock);
+    if (in != NULL)
+        pthread_mutex_lock(&in->lock);
+
+    memset(&adev->voip_downlink, 0, sizeof(adev->voip_downlink));
+    memset(&adev->voip_uplink, 0, sizeof(adev->voip_uplink));
+    sco_scratch_free(&adev->sco_out_scratch);
+    sco_scratch_free(&adev->sco_in_scratch);
+
+    if (in != NULL)
+        pthread_mutex_unlock(&in->lock);
+    if (out != NULL)
+        pthread_mutex_unlock(&out->lock);
+}
+
+/* no lock needed, only touches the new pcm */
+static struct pcm *sco_open_pcm(unsigned int card, unsigned int flags,
+                                struct pcm_config *config)
+{
+    struct pcm *pcm = pcm_open(card, PCM_DEVICE, flags | PCM_MONOTONIC, config);
+
+    if (pcm == NULL)
+        return NULL;
+    if (!pcm_is_ready(pcm) || pcm_prepare(pcm) != 0) {
+        ALOGW("%s : %s not prepared: %s", __func__,
+                flags & PCM_IN ? "capture" : "playback", pcm_get_error(pcm));
+        pcm_close(pcm);
+        return NULL;
+    }
+
+    return pcm;
+}
+
+/*
+ * must be called with hw device mutex locked. Takes the pending preparation:
+ * looks the BT card up again and sets up the filters. Returns false when
+ * there is nothing to open.
+ */
+static bool sco_prepare_begin(struct audio_device *adev)
+{
+    if (!adev->sco_prep_pending)
+        return false;
+    adev->sco_prep_pending = false;
+
+    update_bt_card(adev);
+    return alloc_sco_resources(adev) == 0;
+}
+
+/* must be called with hw device mutex locked. Hands the pcms over to the streams. */
+static void sco_prepare_end(struct audio_device *adev, struct pcm *pcm_out,
+                            struct pcm *pcm_in, int64_t start)
+{
+    if (pcm_out != NULL) {
+        if (adev->sco_pcm_out == NULL)
+            adev->sco_pcm_out = pcm_out;
+        else
+            pcm_close(pcm_out);
+    }
+    if (pcm_in != NULL) {
+        if (adev->sco_pcm_in == NULL)
+            adev->sco_pcm_in = pcm_in;
+        else
+            pcm_close(pcm_in);
+    }
+
+    ALOGD("%s : card %d, out %s, in %s, %" PRId64 " us", __func__, adev->bt_card,
+            adev->sco_pcm_out != NULL ? "ready" : "not ready",
+            adev->sco_pcm_in != NULL ? "ready" : "not ready",
+            (monotonic_ns() - start) / 1000);
+}
 
-static void select_devices(struct audio_device *adev)
+/*
+ * must be called with hw device mutex locked. Does everything a call needs
+ * before its first buffer: looks the BT card up again, sets up the filters and
+ * opens and prepares both BT pcms for start_output_stream() and
+ * start_input_stream() to take. Run by sco_prep_worker() right after BT_SCO=on,
+ * or by the first stream to start if it gets the mutex first; a stream that
+ * comes in while the worker is opening the pcms waits for them instead.
+ */
+static void sco_prepare(struct audio_device *adev)
 {
-    int headphone_on;
-    int speaker_on;
-    int main_mic_on;
-    int headset_mic_on;
+    int64_t start = monotonic_ns();
+    struct pcm *pcm_out = NULL;
+    struct pcm *pcm_in = NULL;
 
-    headphone_on = adev->out_device & (AUDIO_DEVICE_OUT_WIRED_HEADSET |
-                                    AUDIO_DEVICE_OUT_WIRED_HEADPHONE);
-    speaker_on = adev->out_device & AUDIO_DEVICE_OUT_SPEAKER;
-    main_mic_on = adev->in_device & AUDIO_DEVICE_IN_BUILTIN_MIC;
-    headset_mic_on = adev->in_device & AUDIO_DEVICE_IN_WIRED_HEADSET;
+    while (adev->sco_prep_busy)
+        pthread_cond_wait(&adev->sco_prep_cond, &adev->lock);
 
-    audio_route_reset(adev->ar);
-    
-    if (speaker_on)
-        audio_route_apply_path(adev->ar, "speaker");
-    if (headphone_on)
-        audio_route_apply_path(adev->ar, "headphone");
-    if (main_mic_on)
-        audio_route_apply_path(adev->ar, "main-mic");
-    if (headset_mic_on)
-        audio_route_apply_path(adev->ar, "headset-mic");
+    if (!sco_prepare_begin(adev))
+        return;
 
-    audio_route_update_mixer(adev->ar);
-    
-    ALOGV("%s : hp=%c speaker=%c main-mic=%c headset-mic=%c",__func__,
-      headphone_on ? 'y' : 'n', speaker_on ? 'y' : 'n',
-      main_mic_on ? 'y' : 'n', headset_mic_on ? 'y' : 'n' );
+    if (adev->sco_pcm_out == NULL)
+        pcm_out = sco_open_pcm(adev->bt_card, PCM_OUT, &bt_out_config);
+    if (adev->sco_pcm_in == NULL)
+        pcm_in = sco_open_pcm(adev->bt_card, PCM_IN, &bt_in_config);
+    sco_prepare_end(adev, pcm_out, pcm_in, start);
 }
 
-/* must be called with hw device and output stream mutexes locked */
-static void do_out_standby(struct stream_out *out)
+/*
+ * Same as sco_prepare(), but pcm_open() and pcm_prepare() run with the hw
+ * device mutex released so set_parameters and the other streams are not held
+ * up by the BT card. The result is dropped if the call ended meanwhile.
+ */
+static void *sco_prep_worker(void *context)
 {
-    struct audio_device *adev = out->dev;
-    if (!out->standby) {
-        pcm_close(out->pcm);
-        out->pcm = NULL;
-        adev->active_out = NULL;
-        out->standby = true;
+    struct audio_device *adev = (struct audio_device *)context;
+
+    pthread_mutex_lock(&adev->lock);
+    while (!adev->sco_prep_thread_exit) {
+        int64_t start = monotonic_ns();
+        struct pcm *pcm_out = NULL;
+        struct pcm *pcm_in = NULL;
+        unsigned int gen, card;
+        bool open_out, open_in;
+
+        if (!adev->sco_prep_pending) {
+            pthread_cond_wait(&adev->sco_prep_cond, &adev->lock);
+            continue;
+        }
+        if (!sco_prepare_begin(adev))
+            continue;
+
+        gen = adev->sco_prep_gen;
+        card = adev->bt_card;
+        open_out = adev->sco_pcm_out == NULL;
+        open_in = adev->sco_pcm_in == NULL;
+        adev->sco_prep_busy = true;
+        pthread_mutex_unlock(&adev->lock);
+
+        if (open_out)
+            pcm_out = sco_open_pcm(card, PCM_OUT, &bt_out_config);
+        if (open_in)
+            pcm_in = sco_open_pcm(card, PCM_IN, &bt_in_config);
+
+        pthread_mutex_lock(&adev->lock);
+        adev->sco_prep_busy = false;
+        pthread_cond_broadcast(&adev->sco_prep_cond);
+
+        if (gen != adev->sco_prep_gen) {
+            ALOGD("%s : call ended while opening, dropping the pcms", __func__);
+            if (pcm_out != NULL)
+                pcm_close(pcm_out);
+            if (pcm_in != NULL)
+                pcm_close(pcm_in);
+            continue;
+        }
+        sco_prepare_end(adev, pcm_out, pcm_in, start);
     }
+    pthread_mutex_unlock(&adev->lock);
+
+    return NULL;
 }
 
-/* must be called with hw device and input stream mutexes locked */
-static void do_in_standby(struct stream_in *in)
+static void start_sco_prep_worker(struct audio_device *adev)
 {
-    struct audio_device *adev = in->dev;
-    if (!in->standby) {
-        pcm_close(in->pcm);
-        in->pcm = NULL;
-        adev->active_in = NULL;
-        in->standby = true;
+    pthread_cond_init(&adev->sco_prep_cond, NULL);
+
+    if (pthread_create(&adev->sco_prep_thread, NULL, sco_prep_worker, adev) != 0) {
+        ALOGE("%s : failed to start, BT_SCO=on prepares the call inline", __func__);
+        pthread_cond_destroy(&adev->sco_prep_cond);
+        return;
     }
+    adev->sco_prep_thread_started = true;
 }
 
-static int get_pcm_card(const char* name)
+/* must be called without the hw device mutex */
+static void stop_sco_prep_worker(struct audio_device *adev)
 {
-        char id_filepath[PATH_MAX] = {0};
-        char number_filepath[PATH_MAX] = {0};
-        ssize_t written;
+    if (!adev->sco_prep_thread_started)
+        return;
 
-        snprintf(id_filepath, sizeof(id_filepath), "/proc/asound/%s", name);
+    pthread_mutex_lock(&adev->lock);
+    adev->sco_prep_thread_exit = true;
+    pthread_cond_broadcast(&adev->sco_prep_cond);
+    pthread_mutex_unlock(&adev->lock);
 
-        written = readlink(id_filepath, number_filepath, sizeof(number_filepath));
-        if (written < 0) {
-            ALOGE("Sound card %s does not exist\n", name);
-            return -1;
-        } else if (written >= (ssize_t)sizeof(id_filepath)) {
-            ALOGE("Sound card %s name is too long - setting default \n", name);
-            return -1;
-        }
-        ALOGI("Sound card %s exists\n", name);
-        return atoi(number_filepath + 4);
+    pthread_join(adev->sco_prep_thread, NULL);
+    pthread_cond_destroy(&adev->sco_prep_cond);
+    adev->sco_prep_thread_started = false;
 }
+//BT SCO VoIP Call]
 
-void update_bt_card(struct audio_device *adev){
-    adev->bt_card = get_pcm_card(AUDIO_BT_DRIVER_NAME); //update driver name if changed from BT side.
+/* must be called with output stream mutex locked, after a successful pcm_write() */
+static void update_out_drain_deadline(struct stream_out *out)
+{
+    unsigned int avail;
+    struct timespec ts;
+    unsigned int kernel_buffer_size = out->pcm_config->period_size * out->pcm_config->period_count;
+
+    if (pcm_get_htimestamp(out->pcm, &avail, &ts) != 0 || avail > kernel_buffer_size)
+        return;
+
+    out->drain_deadline_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec +
+            (int64_t)(kernel_buffer_size - avail) * 1000000000LL / out->pcm_config->rate;
 }
 
-static unsigned int round_to_16_mult(unsigned int size)
+/*
+ * must be called with output stream mutex locked, after pcm_write() returned
+ * -EPIPE on a PCM_NORESTART pcm. Accounts for the underrun and recovers with
+ * recover_pcm_xrun(), priming a period of silence when xrun_prefill is set.
+ */
+static int recover_out_xrun(struct stream_out *out, const void *buffer, size_t bytes)
 {
-    return (size + 15) & ~15;   /* 0xFFFFFFF0; */
+    int64_t now = monotonic_ns();
+    uint64_t xruns = atomic_fetch_add_explicit(&out->stats.xruns, 1, memory_order_relaxed) + 1;
+    bool prefill = out->dev->xrun_prefill && out->silence != NULL;
+    int ret;
+
+    if (out->drain_deadline_ns != 0 && now > out->drain_deadline_ns)
+        out->xrun_lost_ns += now - out->drain_deadline_ns;
+    out->drain_deadline_ns = 0;
+
+    ALOGW("%s : underrun %" PRIu64 ", %" PRIu64 " ms lost so far", __func__,
+            xruns, out->xrun_lost_ns / 1000000);
+
+    ret = recover_pcm_xrun(&out->stats, out->pcm, prefill ? out->silence : NULL,
+            pcm_frames_to_bytes(out->pcm, out->pcm_config->period_size), buffer, bytes);
+    if (ret == 0 && prefill)
+        out->xrun_silence_frames += out->pcm_config->period_size;
+
+    return ret;
 }
 
 /* must be called with hw device and output stream mutexes locked */
 static int start_output_stream(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
+    int64_t open_start;
+    bool direct = false;
 
     ALOGV("%s : config : [rate %d format %d channels %d]",__func__,
             out->pcm_config->rate, out->pcm_config->format, out->pcm_config->channels);
@@ -280,19 +2847,85 @@ static int start_output_stream(struct stream_out *out)
         return -ENODEV;
     }
 
+    if (out->src != NULL)
+        stream_src_reset(out->src);
+
+    /* warm pcms are on the primary card, a call needs the BT one */
+    if (out->warm && adev->in_sco_voip_call)
+        do_out_standby(out);
+
+    if (out->warm) {
+        /* still open from do_out_standby_delayed(), pcm_write() restarts it */
+        ALOGV("%s : reusing warm pcm", __func__);
+        unlink_warm_output(out);
+        adev->active_out = out;
+        select_devices(adev);
+        if (adev->out_direct == out) {
+            adev->outs_playing++;
+            update_out_sharing(adev);
+        }
+        return 0;
+    }
+
+    if (adev->out_mmap != NULL && !adev->in_sco_voip_call) {
+        ALOGW("%s : card taken by an mmap output", __func__);
+        return -EBUSY;
+    }
+
+    if (out->ring.data != NULL && !adev->in_sco_voip_call) {
+        if (adev->outs_playing == 0) {
+            struct stream_out *warm = adev->out_direct;
+
+            /* alone: a warm output and the idle mixer give the card back first */
+            if (warm != NULL && warm != out) {
+                pthread_mutex_lock(&warm->lock);
+                do_out_standby(warm);
+                pthread_mutex_unlock(&warm->lock);
+            }
+            out_mixer_release(adev);
+            direct = true;
+        } else if (out_mixer_attach(out) == 0) {
+            adev->outs_playing++;
+            adev->active_out = out;
+            select_devices(adev);
+            update_out_sharing(adev);
+            return 0;
+        } else {
+            ALOGW("%s : mixer full, opening the card directly", __func__);
+        }
+    }
+
+    open_start = monotonic_ns();
+
 //[BT SCO VoIP Call
     if(adev->in_sco_voip_call) {
         ALOGD("%s : sco voip call active", __func__);
 
-        ALOGV("%s : opening pcm [%d : %d] for config : [rate %d format %d channels %d]", __func__, adev->bt_card, PCM_DEVICE,
-                bt_out_config.rate, bt_out_config.format, bt_out_config.channels);
+        if (adev->sco_out != NULL) {
+            ALOGE("%s : BT playback already taken by another output", __func__);
+            return -EBUSY;
+        }
+        sco_prepare(adev);
+        /* the call can end while waiting for the worker, try again next buffer */
+        if (!adev->in_sco_voip_call)
+            return -EAGAIN;
+        if (adev->sco_pcm_out != NULL) {
+            out->pcm = adev->sco_pcm_out;
+            adev->sco_pcm_out = NULL;
+        } else {
+            ALOGV("%s : opening pcm [%d : %d] for config : [rate %d format %d channels %d]", __func__, adev->bt_card, PCM_DEVICE,
+                    bt_out_config.rate, bt_out_config.format, bt_out_config.channels);
 
-        out->pcm = pcm_open(adev->bt_card, PCM_DEVICE /*0*/, PCM_OUT, &bt_out_config);
+            /* monotonic timestamps date the echo reference blocks */
+            out->pcm = pcm_open(adev->bt_card, PCM_DEVICE /*0*/, PCM_OUT | PCM_MONOTONIC,
+                    &bt_out_config);
+        }
 //BT SCO VoIP Call]
     } else {
         ALOGI("PCM playback card selected = %d, \n", adev->card);
         out->pcm = pcm_open(adev->card, PCM_DEVICE, PCM_OUT | PCM_NORESTART | PCM_MONOTONIC, out->pcm_config);
     }
+    stats_record_open(&out->stats, monotonic_ns() - open_start);
 
     if (!out->pcm) {
         ALOGE("pcm_open(out) failed: device not found");
@@ -305,6 +2938,14 @@ static int start_output_stream(struct stream_out *out)
     }
 
     adev->active_out = out;
+    if (adev->in_sco_voip_call)
+        adev->sco_out = out;
+    if (direct) {
+        adev->out_direct = out;
+        adev->outs_playing++;
+        update_mixer_card(adev);
+        update_out_sharing(adev);
+    }
 
     /* force mixer updates */
     select_devices(adev);
@@ -312,28 +2953,292 @@ static int start_output_stream(struct stream_out *out)
     return 0;
 }
 
+static void count_lost_input_frames(struct stream_in *in, uint64_t frames)
+{
+    in->frames_lost_total += frames;
+    if (frames > UINT32_MAX - in->frames_lost)
+        in->frames_lost = UINT32_MAX;
+    else
+        in->frames_lost += frames;
+}
+
+/*
+ * must be called with input stream mutex locked, after a successful read of
+ * hw_frames pcm frames that gave the client frames frames. pcm_read() restarts
+ * the pcm on an overrun without reporting it, so the frames the card captured
+ * between two reads are checked against the time that passed: a shortfall of
+ * more than a period is what the kernel dropped.
+ */
+static void update_capture_timeline(struct stream_in *in, size_t hw_frames, size_t frames)
+{
+    unsigned int avail;
+    struct timespec ts;
+    int64_t now;
+    uint64_t captured;
+    uint64_t expected;
+
+    in->frames_read += frames;
+    in->frames_captured += frames;
+    in->hw_frames += hw_frames;
+
+    /* the hub accounts for its overruns in in_hub_read() */
+    if (in->hubbed || pcm_get_htimestamp(in->pcm, &avail, &ts) != 0)
+        return;
+
+    now = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    captured = in->hw_frames + avail;
+
+    if (in->last_capture_ns != 0 && now > in->last_capture_ns) {
+        int64_t elapsed = now - in->last_capture_ns;
+
+        expected = (uint64_t)(elapsed / 1000000000LL) * in->pcm_rate +
+                (uint64_t)(elapsed % 1000000000LL) * in->pcm_rate / 1000000000LL;
+        if (expected > captured - in->last_hw_frames + in->pcm_config->period_size) {
+            uint64_t lost_hw = expected - (captured - in->last_hw_frames);
+            uint64_t lost = lost_hw * in->req_config.sample_rate / in->pcm_rate;
+
+            ALOGW("%s : overrun, %" PRIu64 " frames lost", __func__, lost);
+            stats_add(&in->stats.xruns, 1);
+            in->hw_frames += lost_hw;
+            captured += lost_hw;
+            in->frames_captured += lost;
+            count_lost_input_frames(in, lost);
+        }
+    }
+
+    in->last_capture_ns = now;
+    in->last_hw_frames = captured;
+}
+
+/*
+ * must be called with input stream mutex locked. Copies frames card frames
+ * from the hub ring at the stream's position, waiting for the worker when it
+ * caught up. A reader the worker lapped skips to the newest period and counts
+ * what it missed as lost.
+ */
+static int in_hub_read(struct stream_in *in, int16_t *buf, size_t frames)
+{
+    struct in_hub *hub = &in->dev->in_hub;
+    size_t channels = pcm_config_in.channels;
+    size_t period = pcm_config_in.period_size;
+    size_t done = 0;
+
+    while (done < frames) {
+        uint64_t head = atomic_load_explicit(&hub->head, memory_order_acquire);
+        size_t offset, n, first;
+
+        /* the period after head is being overwritten, keep clear of it */
+        if (head - in->hub_pos > hub->frames - period) {
+            uint64_t lost = head - period - in->hub_pos;
+
+            ALOGW("%s : overrun, %" PRIu64 " frames lost", __func__, lost);
+            stats_add(&in->stats.xruns, 1);
+            lost = lost * in->req_config.sample_rate / pcm_config_in.rate;
+            in->frames_captured += lost;
+            count_lost_input_frames(in, lost);
+            in->hub_pos = head - period;
+        }
+
+        if (head == in->hub_pos) {
+            int64_t deadline_ns = monotonic_ns() +
+                    frames_to_ns(period, pcm_config_in.rate) + IN_HUB_RETRY_MS * 1000000LL;
+            struct timespec ts = {
+                .tv_sec = deadline_ns / 1000000000LL,
+                .tv_nsec = deadline_ns % 1000000000LL,
+            };
+            int ret = 0;
+
+            pthread_mutex_lock(&hub->lock);
+            while (ret == 0 && atomic_load_explicit(&hub->head, memory_order_relaxed) ==
+                    in->hub_pos)
+                ret = pthread_cond_timedwait(&hub->data_cond, &hub->lock, &ts);
+            pthread_mutex_unlock(&hub->lock);
+            if (ret != 0) {
+                ALOGW("%s : hub stalled", __func__);
+                return -ETIMEDOUT;
+            }
+            continue;
+        }
+
+        n = head - in->hub_pos;
+        if (n > frames - done)
+            n = frames - done;
+        offset = in->hub_pos % hub->frames;
+        first = hub->frames - offset;
+        if (first > n)
+            first = n;
+        memcpy(buf + done * channels, hub->data + offset * channels,
+                first * channels * SAMPLE_SIZE_IN_BYTES);
+        memcpy(buf + (done + first) * channels, hub->data,
+                (n - first) * channels * SAMPLE_SIZE_IN_BYTES);
+
+        /* lapped while copying, the frames may be torn: start over from the top */
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&hub->head, memory_order_relaxed) + period >
+                in->hub_pos + hub->frames)
+            continue;
+
+        in->hub_pos += n;
+        done += n;
+    }
+
+    return 0;
+}
+
+/* must be called with input stream mutex locked. bytes of card frames */
+static int in_read_card(struct stream_in *in, void *buf, size_t bytes)
+{
+    int64_t start;
+    int ret;
+
+    if (!in->hubbed)
+        return stats_pcm_read(&in->stats, in->pcm, buf, bytes);
+
+    start = monotonic_ns();
+    ret = in_hub_read(in, (int16_t *)buf,
+            bytes / (pcm_config_in.channels * SAMPLE_SIZE_IN_BYTES));
+    stats_record_io(&in->stats, monotonic_ns() - start);
+    return ret;
+}
+
+/*
+ * must be called with input stream mutex locked. Card position of the hub as
+ * of its last period, in the stream's frames.
+ */
+static int in_hub_position(struct stream_in *in, int64_t *frames, int64_t *time)
+{
+    struct in_hub *hub = &in->dev->in_hub;
+    int ret = -ENODATA;
+
+    pthread_mutex_lock(&hub->lock);
+    if (hub->captured_ns != 0 && hub->captured >= in->hub_pos) {
+        *frames = in->frames_captured + (hub->captured - in->hub_pos) *
+                in->req_config.sample_rate / pcm_config_in.rate;
+        *time = hub->captured_ns;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    return ret;
+}
+
+/*
+ * must be called with input stream mutex locked. Converts frames frames of
+ * pcm_config format (48 kHz stereo) in buf to the client's channel count and
+ * rate, in place, and returns the number of client frames left in buf.
+ */
+static size_t in_convert(struct stream_in *in, int16_t *buf, size_t frames)
+{
+    size_t channels = popcount(in->req_config.channel_mask);
+    size_t produced = 0;
+    size_t done;
+
+    if (in->fold_mono)
+        fold_stereo_to_mono(buf, frames);
+    if (in->src == NULL)
+        return frames;
+
+    /* decimation never writes ahead of the input still to be read */
+    for (done = 0; done < frames; ) {
+        size_t n = frames - done;
+
+        if (n > in->src->max_frames)
+            n = in->src->max_frames;
+        produced += stream_src_process(in->src, buf + done * channels, n,
+                buf + produced * channels);
+        done += n;
+    }
+
+    return produced;
+}
+
+/*
+ * must be called with input stream mutex locked. Fills frames client frames
+ * from the primary card through in_convert(), reading only the card frames
+ * they take so the conversion state carries over to the next read.
+ */
+static int in_read_converted(struct stream_in *in, int16_t *buffer, size_t frames)
+{
+    size_t channels = popcount(in->req_config.channel_mask);
+    size_t frame_size = in->pcm_config->channels * SAMPLE_SIZE_IN_BYTES;
+    size_t done = 0;
+    size_t hw_done = 0;
+    int ret = 0;
+
+    while (done < frames) {
+        size_t hw_frames = frames - done;
+        size_t produced;
+
+        if (in->src != NULL)
+            hw_frames = stream_src_input_frames(in->src, hw_frames);
+        if (hw_frames > IN_CONV_CHUNK_FRAMES)
+            hw_frames = IN_CONV_CHUNK_FRAMES;
+
+        ret = in_read_card(in, in->conv_buf, hw_frames * frame_size);
+        if (ret != 0)
+            return ret;
+
+        produced = in_convert(in, in->conv_buf, hw_frames);
+        memcpy(buffer + done * channels, in->conv_buf,
+                produced * channels * SAMPLE_SIZE_IN_BYTES);
+        done += produced;
+        hw_done += hw_frames;
+    }
+
+    update_capture_timeline(in, hw_done, done);
+    return 0;
+}
+
 /* must be called with hw device and input stream mutexes locked */
 static int start_input_stream(struct stream_in *in)
 {
     struct audio_device *adev = in->dev;
+    int64_t open_start;
+
+    if (in->src != NULL)
+        stream_src_reset(in->src);
+    in->sco_avail = 0;
+
+    open_start = monotonic_ns();
 
 //[BT SCO VoIP Call
     if(adev->in_sco_voip_call) {
         ALOGD("%s : sco voip call active", __func__);
 
-        ALOGV("%s : opening pcm [%d : %d] for config : [rate %d format %d channels %d]",__func__, adev->bt_card, PCM_DEVICE,
-                bt_in_config.rate, bt_in_config.format, bt_in_config.channels);
+        if (adev->sco_in != NULL) {
+            ALOGE("%s : BT capture already taken by another input", __func__);
+            return -EBUSY;
+        }
+        sco_prepare(adev);
+        /* the call can end while waiting for the worker, try again next buffer */
+        if (!adev->in_sco_voip_call)
+            return -EAGAIN;
+        if (adev->sco_pcm_in != NULL) {
+            in->pcm = adev->sco_pcm_in;
+            adev->sco_pcm_in = NULL;
+        } else {
+            ALOGV("%s : opening pcm [%d : %d] for config : [rate %d format %d channels %d]",__func__, adev->bt_card, PCM_DEVICE,
+                    bt_in_config.rate, bt_in_config.format, bt_in_config.channels);
 
-        in->pcm = pcm_open(adev->bt_card, PCM_DEVICE, PCM_IN, &bt_in_config);
+            in->pcm = pcm_open(adev->bt_card, PCM_DEVICE, PCM_IN | PCM_MONOTONIC, &bt_in_config);
+        }
+        in->pcm_rate = bt_in_config.rate;
 //BT SCO VoIP Call]
+    } else if (in->hub_capable && in_hub_attach(in) == 0) {
+        in->pcm_rate = pcm_config_in.rate;
+        adev->active_in = in;
+        select_devices(adev);
+        return 0;
     } else {
         ALOGI("PCM record card selected = %d, \n", adev->card);
 
         ALOGV("%s : config : [rate %d format %d channels %d]",__func__,
             in->pcm_config->rate, in->pcm_config->format, in->pcm_config->channels);
 
-        in->pcm = pcm_open(adev->cardc, PCM_DEVICE, PCM_IN, in->pcm_config);
+        in->pcm = pcm_open(adev->cardc, PCM_DEVICE, PCM_IN | PCM_MONOTONIC, in->pcm_config);
+        in->pcm_rate = in->pcm_config->rate;
     }
+    stats_record_open(&in->stats, monotonic_ns() - open_start);
 
     if (!in->pcm) {
         return -ENODEV;
@@ -344,6 +3249,8 @@ static int start_input_stream(struct stream_in *in)
     }
 
     adev->active_in = in;
+    if (adev->in_sco_voip_call)
+        adev->sco_in = in;
 
     /* force mixer updates */
     select_devices(adev);
@@ -368,9 +3275,16 @@ static int out_set_sample_rate(struct audio_stream *stream __unused, uint32_t ra
 
 static size_t out_get_buffer_size(const struct audio_stream *stream)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+    size_t frames = out->pcm_config->period_size;
+
     ALOGV("out_get_buffer_size");
-    return pcm_config_out.period_size *
-               audio_stream_out_frame_size((struct audio_stream_out *)stream);
+    /* one card period worth of client frames, a multiple of 16 frames */
+    if (out->src != NULL)
+        frames = round_to_16_mult((frames * out->src->rate_in + out->src->rate_out - 1) /
+                out->src->rate_out);
+
+    return frames * audio_stream_out_frame_size((struct audio_stream_out *)stream);
 }
 
 static uint32_t out_get_channels(const struct audio_stream *stream)
@@ -398,17 +3312,40 @@ static int out_standby(struct audio_stream *stream)
 
     ALOGV("out_standby");
     pthread_mutex_lock(&out->dev->lock);
+    publish_ctl_state(out->dev);
     pthread_mutex_lock(&out->lock);
-    do_out_standby(out);
+    do_out_standby_delayed(out);
     pthread_mutex_unlock(&out->lock);
     pthread_mutex_unlock(&out->dev->lock);
 
     return 0;
 }
 
-static int out_dump(const struct audio_stream *stream __unused, int fd __unused)
+static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+
     ALOGV("out_dump");
+    dprintf(fd, "\n  Output stream %p, flags %#x, client [rate %u channels %u]:\n", out,
+            out->flags, out->req_config.sample_rate, popcount(out->req_config.channel_mask));
+    stats_dump(&out->stats, fd, "pcm_write");
+
+    if (pthread_mutex_trylock(&out->lock) != 0) {
+        dprintf(fd, "    Could not obtain stream lock.\n");
+        return 0;
+    }
+
+    dprintf(fd, "    pcm: [rate %u channels %u period %u count %u], %s%s\n",
+            out->pcm_config->rate, out->pcm_config->channels,
+            out->pcm_config->period_size, out->pcm_config->period_count,
+            out->warm ? "warm standby" : out->standby ? "standby" : "active",
+            out->mixed ? " on mixer" : out->ctl_state & CTL_SCO_VOIP_CALL ? " on SCO" : "");
+    dprintf(fd, "    frames written: %" PRIu64 ", presented: %" PRIu64 "\n",
+            out->written, out->last_presented);
+    dprintf(fd, "    underrun time lost: %" PRIu64 " ms, silence primed: %" PRIu64 " frames\n",
+            out->xrun_lost_ns / 1000000, out->xrun_silence_frames);
+
+    pthread_mutex_unlock(&out->lock);
     return 0;
 }
 
@@ -452,67 +3389,230 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
     return status;
 }
 
-static char *out_get_parameters(const struct audio_stream *stream, const char *keys)
-{
-    ALOGV("%s : keys : %s",__func__,keys);
-    struct stream_out *out = (struct stream_out *)stream;
-    struct str_parms *query = str_parms_create_str(keys);
-    char *str_parm = NULL;
-    char value[256];
-    struct str_parms *reply = str_parms_create();
-    int ret;
+static char *out_get_parameters(const struct audio_stream *stream, const char *keys)
+{
+    ALOGV("%s : keys : %s",__func__,keys);
+    struct stream_out *out = (struct stream_out *)stream;
+    struct str_parms *query = str_parms_create_str(keys);
+    char *str_parm = NULL;
+    char value[256];
+    struct str_parms *reply = str_parms_create();
+    int ret;
+
+    if(reply == NULL || query == NULL) {
+        if(reply != NULL) str_parms_destroy(reply);
+        if(query != NULL) str_parms_destroy(query);
+        return NULL;
+    }
+
+    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_FORMATS, value, sizeof(value));
+    if (ret >= 0) {
+        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_FORMATS, "AUDIO_FORMAT_PCM_16_BIT");
+        str_parm = str_parms_to_str(reply);
+    }
+
+    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES, value, sizeof(value));
+    if (ret >= 0) {
+        str_parms_add_int(reply, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES, out->req_config.sample_rate);
+
+        if(str_parm != NULL)
+            str_parms_destroy((struct str_parms *)str_parm);
+
+        str_parm = str_parms_to_str(reply);
+    }
+
+    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value, sizeof(value));
+    if (ret >= 0) {
+        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS,
+            (out->req_config.channel_mask == AUDIO_CHANNEL_OUT_MONO ? "AUDIO_CHANNEL_OUT_MONO" : "AUDIO_CHANNEL_OUT_STEREO"));
+
+        if(str_parm != NULL)
+            str_parms_destroy((struct str_parms *)str_parm);
+
+        str_parm = str_parms_to_str(reply);
+    }
+
+    str_parms_destroy(query);
+    str_parms_destroy(reply);
+
+    ALOGV("%s : returning keyValuePair %s",__func__, str_parm);
+    return str_parm;
+}
+
+static uint32_t out_get_latency(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    uint32_t latency;
+
+    ALOGV("out_get_latency");
+    latency = (out->pcm_config->period_size * out->pcm_config->period_count * 1000) /
+               out->pcm_config->rate;
+    /* the ring stands in for the stream's own buffer, the mixer queues more behind it */
+    if (out->mixed) {
+        struct out_mixer *mix = &out->dev->out_mixer;
+
+        pthread_mutex_lock(&mix->lock);
+        latency += mix->config.period_size * mix->config.period_count * 1000 /
+                pcm_config_out_mixer.rate;
+        pthread_mutex_unlock(&mix->lock);
+    }
+    /* group delay of the rate converter */
+    if (out->src != NULL)
+        latency += out->src->taps * 1000 / (2 * out->src->rate_in);
+
+    return latency;
+}
+
+static int out_set_volume(struct audio_stream_out *stream, float left,
+                          float right)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+
+    ALOGV("out_set_volume: Left:%f Right:%f", left, right);
+
+    /* mmap clients write to the DMA ring directly */
+    if (out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ)
+        return -ENOSYS;
+
+    atomic_store_explicit(&out->volume, gain_pack(gain_to_q15(left), gain_to_q15(right)),
+            memory_order_relaxed);
+    return 0;
+}
+
+/* stream volume scaled by the part of master volume left to software */
+static unsigned int out_target_gain(const struct stream_out *out)
+{
+    unsigned int volume = atomic_load_explicit(&out->volume, memory_order_relaxed);
+    unsigned int master = atomic_load_explicit(&out->dev->master_gain, memory_order_relaxed);
+    unsigned int c, gain[2];
+
+    if (master == GAIN_PACKED_UNITY)
+        return volume;
+    for (c = 0; c < 2; c++)
+        gain[c] = gain_channel(volume, c) * gain_channel(master, c) / GAIN_UNITY;
+
+    return gain_pack(gain[0], gain[1]);
+}
+
+//[BT SCO VoIP Call
+/*
+ * must be called with output stream mutex locked. When the next frame written
+ * to the BT card will be played: the frames still queued in it, from the time
+ * of its last update. Now when the card is not running yet.
+ */
+static int64_t sco_out_play_ns(struct stream_out *out)
+{
+    unsigned int avail;
+    struct timespec ts;
+    unsigned int kernel_buffer_size = bt_out_config.period_size * bt_out_config.period_count;
+
+    if (pcm_get_htimestamp(out->pcm, &avail, &ts) != 0 || avail > kernel_buffer_size)
+        return monotonic_ns();
+
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec +
+            frames_to_ns(kernel_buffer_size - avail, bt_out_config.rate);
+}
+//BT SCO VoIP Call]
+
+/*
+ * must be called with output stream mutex locked. Writes frames at the card
+ * rate, to the BT card through the SCO downlink during a VoIP call. Returns
+ * 0, -EPIPE when an underrun could not be recovered or the pcm_write error.
+ */
+static int out_write_frames(struct stream_out *out, unsigned int ctl,
+                            const int16_t *buffer, size_t frames, size_t frame_size)
+{
+    struct audio_device *adev = out->dev;
+    int ret = 0;
+
+//[BT SCO VoIP Call
+    if(ctl & CTL_SCO_VOIP_CALL) {
+        /*
+         * VoIP pcm write in celadon devices goes to bt alsa card. Every client
+         * frame goes through the downlink filter, which keeps what does not
+         * complete an 8 kHz sample; its output collects in the current echo
+         * reference block and goes out one BT period at a time.
+         */
+        struct sco_scratch *scratch = &adev->sco_out_scratch;
+        struct echo_ref *ref = &adev->echo_ref;
+        size_t period = bt_out_config.period_size;
+        size_t done;
+
+        if (scratch->base == NULL) {
+            ALOGE("%s : sco scratch buffers not available", __func__);
+            return -ENOMEM;
+        }
+
+        for (done = 0; done < frames && ret == 0; ) {
+            const int16_t *buf_in = (const int16_t *)((const char *)buffer + done * frame_size);
+            uint64_t seq = atomic_load_explicit(&ref->seq, memory_order_relaxed);
+            struct echo_ref_block *block = &ref->blocks[seq % ECHO_REF_BLOCKS];
+            size_t frames_in = sco_downlink_max_input(&adev->voip_downlink,
+                    period - adev->sco_out_fill);
+            size_t frames_out;
+            size_t buf_size_out;
+
+            if (frames_in > frames - done)
+                frames_in = frames - done;
+
+            /* readers must see the block as in progress before any of it changes */
+            if (adev->sco_out_fill == 0) {
+                atomic_store_explicit(&block->gen, 2 * seq + 1, memory_order_relaxed);
+                atomic_thread_fence(memory_order_release);
+            }
+
+            pcm_dump_write(adev->dump_taps[DUMP_SCO_CALL_WRITE], buf_in,
+                    frames_in * SAMPLE_SIZE_IN_BYTES_STEREO, pcm_config_out.rate, 2);
 
-    if(reply == NULL || query == NULL) {
-        if(reply != NULL) str_parms_destroy(reply);
-        if(query != NULL) str_parms_destroy(query);
-        return NULL;
-    }
+            frames_out = sco_downlink_process(&adev->voip_downlink, buf_in, frames_in,
+                    block->data + adev->sco_out_fill);
+            adev->sco_out_fill += frames_out;
+            done += frames_in;
 
-    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_FORMATS, value, sizeof(value));
-    if (ret >= 0) {
-        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_FORMATS, "AUDIO_FORMAT_PCM_16_BIT");
-        str_parm = str_parms_to_str(reply);
-    }
+            ALOGV("%s : frames_in %zu frames_out %zu",__func__, frames_in, frames_out);
 
-    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES, value, sizeof(value));
-    if (ret >= 0) {
-        str_parms_add_int(reply, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES, out->req_config.sample_rate);
+            if (adev->sco_out_fill < period)
+                continue;
 
-        if(str_parm != NULL)
-            str_parms_destroy((struct str_parms *)str_parm);
+            buf_size_out = bt_out_config.channels * period * SAMPLE_SIZE_IN_BYTES;
 
-        str_parm = str_parms_to_str(reply);
-    }
+            pcm_dump_write(adev->dump_taps[DUMP_SCO_CALL_WRITE_BT], block->data, buf_size_out,
+                    bt_out_config.rate, bt_out_config.channels);
 
-    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value, sizeof(value));
-    if (ret >= 0) {
-        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS,
-            (out->req_config.channel_mask == AUDIO_CHANNEL_OUT_MONO ? "AUDIO_CHANNEL_OUT_MONO" : "AUDIO_CHANNEL_OUT_STEREO"));
+            block->frames = period;
+            block->play_ns = sco_out_play_ns(out);
+            adev->sco_out_fill = 0;
 
-        if(str_parm != NULL)
-            str_parms_destroy((struct str_parms *)str_parm);
+            ret = stats_pcm_write(&out->stats, out->pcm, block->data, buf_size_out);
+            if (ret == 0) {
+                atomic_store_explicit(&block->gen, 2 * seq + 2, memory_order_release);
+                atomic_store_explicit(&ref->seq, seq + 1, memory_order_release);
+            }
+        }
+//BT SCO VoIP Call]
+    } else if (out->mixed) {
+        /* primary card through the software mixer */
+        int64_t start = monotonic_ns();
 
-        str_parm = str_parms_to_str(reply);
-    }
+        ret = out_mixer_write(out, buffer, frames);
+        stats_record_io(&out->stats, monotonic_ns() - start);
 
-    str_parms_destroy(query);
-    str_parms_destroy(reply);
+        pcm_dump_write(out->dump_tap, buffer, frames * frame_size,
+                out->pcm_config->rate, frame_size / SAMPLE_SIZE_IN_BYTES);
+    } else {
+        /* Normal pcm out to primary card */
+        ret = stats_pcm_write(&out->stats, out->pcm, buffer, frames * frame_size);
 
-    ALOGV("%s : returning keyValuePair %s",__func__, str_parm);
-    return str_parm;
-}
+        pcm_dump_write(out->dump_tap, buffer, frames * frame_size,
+                out->pcm_config->rate, frame_size / SAMPLE_SIZE_IN_BYTES);
 
-static uint32_t out_get_latency(const struct audio_stream_out *stream __unused)
-{
-    ALOGV("out_get_latency");
-    return (pcm_config_out.period_size * OUT_PERIOD_COUNT * 1000) / pcm_config_out.rate;
-}
+        if (ret == -EPIPE)
+            ret = recover_out_xrun(out, buffer, frames * frame_size) ? -EPIPE : 0;
+        if (ret == 0)
+            update_out_drain_deadline(out);
+    }
 
-static int out_set_volume(struct audio_stream_out *stream __unused, float left __unused,
-                          float right __unused)
-{
-     ALOGV("out_set_volume: Left:%f Right:%f", left, right);
-     return -ENOSYS;
+    return ret;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -524,150 +3624,146 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     size_t frame_size = audio_stream_out_frame_size(stream);
     int16_t *out_buffer = (int16_t *)buffer;
     unsigned int out_frames = bytes / frame_size;
+    unsigned int ctl;
+    unsigned int gain;
+    int64_t deadline_ns = 0;
+    int64_t wait_start;
 
     ALOGV("out_write: bytes: %zu", bytes);
 
-    /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the output stream mutex - e.g.
-     * executing out_set_parameters() while holding the hw device
-     * mutex
-     */
-    pthread_mutex_lock(&adev->lock);
-    pthread_mutex_lock(&out->lock);
+    /* mmap clients write to the DMA ring directly */
+    if (out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ)
+        return -ENOSYS;
 
-    if(adev->out_needs_standby) {
-        do_out_standby(out);
-        adev->out_needs_standby = false;
-    }
+    pthread_mutex_lock(&out->lock);
+    ctl = atomic_load_explicit(&adev->ctl_state, memory_order_acquire);
+    if (!out->standby && ctl == out->ctl_state &&
+            !atomic_load_explicit(&out->mix_move, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&adev->ctl_fast_path_count, 1, memory_order_relaxed);
+    } else {
+        /*
+         * acquiring hw device mutex is useful if a low priority thread
+         * is waiting on the output stream mutex - e.g. executing
+         * out_set_parameters() while holding the hw device mutex.
+         * Such paths publish a new control state first, which is what
+         * sends us here.
+         */
+        pthread_mutex_unlock(&out->lock);
+        atomic_fetch_add_explicit(&adev->ctl_slow_path_count, 1, memory_order_relaxed);
+        wait_start = monotonic_ns();
+        pthread_mutex_lock(&adev->lock);
+        stats_record_lock_wait(&out->stats, monotonic_ns() - wait_start);
+        pthread_mutex_lock(&out->lock);
 
-    if (out->standby) {
-        if(!adev->is_hfp_call_active) {
-            ret = start_output_stream(out);
-        } else {
-            ret = -1;
+        if(adev->out_needs_standby) {
+            do_out_standby(out);
+            adev->out_needs_standby = false;
+            publish_ctl_state(adev);
         }
-        if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            goto exit;
+        /* the mixer only feeds the primary card, calls move every stream off it */
+        if (out->mixed && (adev->in_sco_voip_call || adev->is_hfp_call_active))
+            do_out_standby(out);
+        /* only the stream on the BT pcm runs the SCO path, see release_sco_resources() */
+        if (!out->standby && (adev->sco_out == out) != adev->in_sco_voip_call)
+            do_out_standby(out);
+        /* another output started or stopped, see update_out_sharing() */
+        if (atomic_exchange_explicit(&out->mix_move, false, memory_order_relaxed) &&
+                !out->standby) {
+            /* what either side queued plays out before the other takes the card */
+            if (out->mixed)
+                out_mixer_drain(out);
+            else if (adev->out_direct == out)
+                out_mixer_hand_over(out);
+            do_out_standby(out);
         }
-        out->standby = false;
-    }
-    pthread_mutex_unlock(&adev->lock);
-
-//[BT SCO VoIP Call
-    if(adev->in_sco_voip_call) {
-        /* VoIP pcm write in celadon devices goes to bt alsa card */
-        size_t frames_in = round_to_16_mult(out->pcm_config->period_size);
-        size_t frames_out = round_to_16_mult(bt_out_config.period_size);
-        size_t buf_size_out = bt_out_config.channels * frames_out * SAMPLE_SIZE_IN_BYTES;
-        size_t buf_size_in = out->pcm_config->channels * frames_in * SAMPLE_SIZE_IN_BYTES;
-        size_t buf_size_remapped = bt_out_config.channels * frames_in * SAMPLE_SIZE_IN_BYTES;
-        int16_t *buf_out = (int16_t *) malloc (buf_size_out);
-        int16_t *buf_in = (int16_t *) malloc (buf_size_in);
-        int16_t *buf_remapped = (int16_t *) malloc (buf_size_remapped);
-
-        if(adev->voip_out_resampler == NULL) {
-            int ret = create_resampler(out->pcm_config->rate /*src rate*/, bt_out_config.rate /*dst rate*/, bt_out_config.channels/*dst channels*/,
-                            RESAMPLER_QUALITY_DEFAULT, NULL, &(adev->voip_out_resampler));
-            ALOGD("%s : frames_in %zu frames_out %zu",__func__, frames_in, frames_out);
-            ALOGD("%s : to write bytes : %zu", __func__, bytes);
-            ALOGD("%s : size_in %zu size_out %zu size_remapped %zu", __func__, buf_size_in, buf_size_out, buf_size_remapped);
 
+        if (out->standby) {
+            if(!adev->is_hfp_call_active) {
+                ret = start_output_stream(out);
+            } else {
+                ret = -1;
+            }
             if (ret != 0) {
-                adev->voip_out_resampler = NULL;
-                ALOGE("%s : Failure to create resampler %d", __func__, ret);
-
-                free(buf_in);
-                free(buf_out);
-                free(buf_remapped);
+                pthread_mutex_unlock(&adev->lock);
                 goto exit;
-            } else {
-                ALOGD("%s : voip_out_resampler created rate : [%d -> %d]", __func__, out->pcm_config->rate, bt_out_config.rate);
             }
+            out->standby = false;
         }
+        ctl = atomic_load_explicit(&adev->ctl_state, memory_order_relaxed);
+        out->ctl_state = ctl;
+        pthread_mutex_unlock(&adev->lock);
+    }
 
-        memset(buf_in, 0, buf_size_in);
-        memset(buf_remapped, 0, buf_size_remapped);
-        memset(buf_out, 0, buf_size_out);
-
-        memcpy(buf_in, buffer, buf_size_in);
-
-#ifdef DEBUG_PCM_DUMP
-        if(sco_call_write != NULL) {
-            fwrite(buf_in, 1, buf_size_in, sco_call_write);
-        } else {
-            ALOGD("%s : sco_call_write was NULL, no dump", __func__);
-        }
-#endif
-
-        adjust_channels(buf_in, out->pcm_config->channels, buf_remapped, bt_out_config.channels, 
-                                        SAMPLE_SIZE_IN_BYTES, buf_size_in);
-
-        //ALOGV("remapping : [%d -> %d]", out->pcm_config->channels, bt_out_config.channels);
-
-#ifdef DEBUG_PCM_DUMP
-        if(sco_call_write_remapped != NULL) {
-            fwrite(buf_remapped, 1, buf_size_remapped, sco_call_write_remapped);
-        } else {
-            ALOGD("%s : sco_call_write_remapped was NULL, no dump", __func__);
-        }
-#endif
-
-        if(adev->voip_out_resampler != NULL) {
-            adev->voip_out_resampler->resample_from_input(adev->voip_out_resampler, (int16_t *)buf_remapped, (size_t *)&frames_in, (int16_t *) buf_out, (size_t *)&frames_out);
-            //ALOGV("%s : upsampling [%d -> %d]",__func__, out->pcm_config->rate, bt_out_config.rate);
-        }
-
-        ALOGV("%s : modified frames_in %zu frames_out %zu",__func__, frames_in, frames_out);
-
-        buf_size_out = bt_out_config.channels * frames_out * SAMPLE_SIZE_IN_BYTES;
-        bytes = out->pcm_config->channels * frames_in * SAMPLE_SIZE_IN_BYTES;
-
-#ifdef DEBUG_PCM_DUMP
-        if(sco_call_write_bt != NULL) {
-            fwrite(buf_out, 1, buf_size_out, sco_call_write_bt);
-        } else {
-            ALOGD("%s : sco_call_write was NULL, no dump", __func__);
+    gain = out_target_gain(out);
+    if (out->src != NULL) {
+        size_t channels = out->src->channels;
+        size_t ramp_frames = GAIN_RAMP_MS * out->pcm_config->rate / 1000;
+        size_t done;
+
+        for (done = 0; done < out_frames && ret == 0; ) {
+            size_t frames = out_frames - done;
+            size_t produced;
+
+            if (frames > out->src->max_frames)
+                frames = out->src->max_frames;
+            produced = stream_src_process(out->src, out_buffer + done * channels, frames,
+                    out->src_buf);
+            if (!gain_is_unity(&out->volume_ramp, gain))
+                gain_apply(&out->volume_ramp, gain, out->src_buf, produced, channels,
+                        ramp_frames);
+            ret = out_write_frames(out, ctl, out->src_buf, produced,
+                    channels * SAMPLE_SIZE_IN_BYTES);
+            done += frames;
         }
-#endif
-
-        ret = pcm_write(out->pcm, buf_out, buf_size_out);
-
-        free(buf_in);
-        free(buf_out);
-        free(buf_remapped);
-//BT SCO VoIP Call]
     } else {
-        /* Normal pcm out to primary card */
-        ret = pcm_write(out->pcm, out_buffer, out_frames * frame_size);
-
-#ifdef DEBUG_PCM_DUMP
-        if(out_write_dump != NULL) {
-            fwrite(out_buffer, 1, out_frames * frame_size, out_write_dump);
-        } else {
-            ALOGD("%s : out_write_dump was NULL, no dump", __func__);
+        if (!gain_is_unity(&out->volume_ramp, gain)) {
+            if (bytes > out->gain_buf_size) {
+                int16_t *gain_buf = (int16_t *)realloc(out->gain_buf, bytes);
+
+                if (gain_buf != NULL) {
+                    out->gain_buf = gain_buf;
+                    out->gain_buf_size = bytes;
+                }
+            }
+            if (bytes <= out->gain_buf_size) {
+                memcpy(out->gain_buf, out_buffer, out_frames * frame_size);
+                out_buffer = out->gain_buf;
+                gain_apply(&out->volume_ramp, gain, out_buffer, out_frames,
+                        frame_size / SAMPLE_SIZE_IN_BYTES,
+                        GAIN_RAMP_MS * out_get_sample_rate(&stream->common) / 1000);
+            } else {
+                ALOGW("%s : no gain buffer, writing at unity", __func__);
+            }
         }
-#endif
+        ret = out_write_frames(out, ctl, out_buffer, out_frames, frame_size);
+    }
 
-        if (ret == -EPIPE) {
-            /* In case of underrun, don't sleep since we want to catch up asap */
-            pthread_mutex_unlock(&out->lock);
-            return ret;
-        }
+    if (ret == -EPIPE) {
+        /* In case of underrun, don't sleep since we want to catch up asap */
+        pthread_mutex_unlock(&out->lock);
+        return ret;
     }
 
     if (ret == 0) {
         out->written += out_frames;
+        stats_add(&out->stats.bytes, bytes);
+        stats_add(&out->stats.frames, out_frames);
     }
 
 exit:
+    if (ret != 0) {
+        /* the buffer is consumed in real time on the virtual timeline */
+        out->written += bytes / frame_size;
+        deadline_ns = stream_pacer_advance(&out->pacer, bytes / frame_size,
+                out_get_sample_rate(&stream->common));
+    } else {
+        stream_pacer_reset(&out->pacer);
+    }
     pthread_mutex_unlock(&out->lock);
 
     if (ret != 0) {
         ALOGW("out_write error: %d, sleeping...", ret);
-        usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
-               out_get_sample_rate(&stream->common));
+        stream_pacer_sleep_until(deadline_ns);
     }
 
     return bytes;
@@ -688,18 +3784,57 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
     struct stream_out *out = (struct stream_out *)stream;
     int ret = -1;
 
-    if (out->pcm) {
+    pthread_mutex_lock(&out->lock);
+    if (out->pcm || out->mixed) {
         unsigned int avail;
-        if (pcm_get_htimestamp(out->pcm, &avail, timestamp) == 0) {
-            unsigned int kernel_buffer_size = out->pcm_config->period_size * out->pcm_config->period_count;
-            int64_t signed_frames = out->written - kernel_buffer_size + avail;
+        uint64_t queued;
+
+        if (out->mixed) {
+            ret = out_mixer_queued(out, &queued, timestamp);
+        } else {
+            ret = pcm_get_htimestamp(out->pcm, &avail, timestamp);
+            if (ret == 0)
+                queued = out->pcm_config->period_size * out->pcm_config->period_count - avail;
+        }
+        if (ret == 0) {
+            int64_t signed_frames;
+
+            /* written counts client frames, the queue is in card frames */
+            if (out->src != NULL)
+                queued = queued * out->src->rate_in / out->src->rate_out;
+            signed_frames = out->written - queued;
             if (signed_frames >= 0) {
-            *frames = signed_frames;
-            ret = 0;
+                /*
+                 * frames dropped by an xrun or a standby were counted as
+                 * written and primed silence sits in the queue, never step
+                 * back over what was already reported
+                 */
+                if ((uint64_t)signed_frames < out->last_presented)
+                    signed_frames = out->last_presented;
+                out->last_presented = signed_frames;
+                *frames = signed_frames;
+            } else {
+                ret = -1;
             }
         }
     }
 
+    /* no device to ask, report the virtual timeline writes are paced on */
+    if (ret != 0 && out->pacer.base_ns != 0) {
+        int64_t now = monotonic_ns();
+        uint64_t pending = stream_pacer_pending(&out->pacer, now);
+        uint64_t presented = out->written > pending ? out->written - pending : 0;
+
+        if (presented < out->last_presented)
+            presented = out->last_presented;
+        out->last_presented = presented;
+        *frames = presented;
+        timestamp->tv_sec = now / 1000000000LL;
+        timestamp->tv_nsec = now % 1000000000LL;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
     return ret;
 }
 
@@ -722,6 +3857,130 @@ static int out_get_next_write_timestamp(const struct audio_stream_out *stream __
     return -ENOSYS;
 }
 
+static int out_start(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    int ret = -ENOSYS;
+
+    ALOGV("%s",__func__);
+    pthread_mutex_lock(&out->lock);
+    if ((out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) && out->pcm != NULL) {
+        ret = 0;
+        if (pcm_start(out->pcm) < 0) {
+            ALOGE("%s : pcm_start failed: %s", __func__, pcm_get_error(out->pcm));
+            ret = -EIO;
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_stop(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    int ret = -ENOSYS;
+
+    ALOGV("%s",__func__);
+    pthread_mutex_lock(&out->lock);
+    if ((out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) && out->pcm != NULL) {
+        ret = 0;
+        if (pcm_stop(out->pcm) < 0) {
+            ALOGE("%s : pcm_stop failed: %s", __func__, pcm_get_error(out->pcm));
+            ret = -EIO;
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_create_mmap_buffer(const struct audio_stream_out *stream,
+                                  int32_t min_size_frames,
+                                  struct audio_mmap_buffer_info *info)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    struct audio_device *adev = out->dev;
+    int64_t open_start;
+    int ret = 0;
+
+    ALOGD("%s : min_size_frames %d", __func__, min_size_frames);
+
+    if (info == NULL || min_size_frames <= 0 ||
+            !(out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ))
+        return -EINVAL;
+
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&out->lock);
+
+    if (!out->standby) {
+        ALOGE("%s : mmap buffer already created", __func__);
+        ret = -EBUSY;
+        goto exit;
+    }
+
+    if (adev->is_hfp_call_active || adev->in_sco_voip_call) {
+        ALOGE("%s : not available during a call", __func__);
+        ret = -ENOSYS;
+        goto exit;
+    }
+
+    /* PCM_DEVICE has one owner: warm outputs and the idle mixer give it back, playing ones keep it */
+    if (adev->outs_playing > 0 || adev->out_mmap != NULL ||
+            (adev->active_out != NULL && adev->active_out != out)) {
+        ALOGE("%s : card taken by another output", __func__);
+        ret = -EBUSY;
+        goto exit;
+    }
+    while (adev->warm_outs != NULL) {
+        struct stream_out *warm = adev->warm_outs;
+
+        pthread_mutex_lock(&warm->lock);
+        do_out_standby(warm);
+        pthread_mutex_unlock(&warm->lock);
+    }
+    out_mixer_release(adev);
+
+    open_start = monotonic_ns();
+    out->pcm = open_mmap_pcm(adev->card, PCM_DEVICE, PCM_OUT, out->pcm_config, min_size_frames, info);
+    stats_record_open(&out->stats, monotonic_ns() - open_start);
+    if (out->pcm == NULL) {
+        ret = -ENODEV;
+        goto exit;
+    }
+
+    out->standby = false;
+    adev->active_out = out;
+    adev->out_mmap = out;
+    update_mixer_card(adev);
+
+    /* force mixer updates */
+    select_devices(adev);
+
+exit:
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+
+    return ret;
+}
+
+static int out_get_mmap_position(const struct audio_stream_out *stream,
+                                 struct audio_mmap_position *position)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    int ret = -ENOSYS;
+
+    if (position == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&out->lock);
+    if ((out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) && out->pcm != NULL)
+        ret = get_mmap_position(out->pcm, position);
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
 /** audio_stream_in implementation **/
 static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
@@ -780,6 +4039,7 @@ static int in_standby(struct audio_stream *stream)
     struct stream_in *in = (struct stream_in *)stream;
 
     pthread_mutex_lock(&in->dev->lock);
+    publish_ctl_state(in->dev);
     pthread_mutex_lock(&in->lock);
     do_in_standby(in);
     pthread_mutex_unlock(&in->lock);
@@ -788,8 +4048,29 @@ static int in_standby(struct audio_stream *stream)
     return 0;
 }
 
-static int in_dump(const struct audio_stream *stream __unused, int fd __unused)
+static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+
+    ALOGV("in_dump");
+    dprintf(fd, "\n  Input stream %p, flags %#x, client [rate %u channels %u]:\n", in,
+            in->flags, in->req_config.sample_rate, popcount(in->req_config.channel_mask));
+    stats_dump(&in->stats, fd, "pcm_read");
+
+    if (pthread_mutex_trylock(&in->lock) != 0) {
+        dprintf(fd, "    Could not obtain stream lock.\n");
+        return 0;
+    }
+
+    dprintf(fd, "    pcm: [rate %u channels %u period %u count %u], %s%s\n",
+            in->pcm_rate ? in->pcm_rate : in->pcm_config->rate, in->pcm_config->channels,
+            in->pcm_config->period_size, in->pcm_config->period_count,
+            in->standby ? "standby" : "active",
+            in->hubbed ? " on hub" : in->ctl_state & CTL_SCO_VOIP_CALL ? " on SCO" : "");
+    dprintf(fd, "    frames read: %" PRIu64 ", captured: %" PRIu64 ", lost: %" PRIu64 "\n",
+            in->frames_read, in->frames_captured, in->frames_lost_total);
+
+    pthread_mutex_unlock(&in->lock);
     return 0;
 }
 
@@ -805,6 +4086,20 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
 
     parms = str_parms_create_str(kvpairs);
 
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_PREROLL_MS, value, sizeof(value));
+    if (ret >= 0) {
+        int preroll_ms = atoi(value);
+
+        if (adev->in_hub.preroll_ms == 0) {
+            status = -ENOSYS;
+        } else {
+            pthread_mutex_lock(&in->lock);
+            in->preroll_ms = preroll_ms < 0 ? 0 : preroll_ms > IN_PREROLL_MS_MAX ?
+                    IN_PREROLL_MS_MAX : preroll_ms;
+            pthread_mutex_unlock(&in->lock);
+        }
+    }
+
     ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING,
                             value, sizeof(value));
     pthread_mutex_lock(&adev->lock);
@@ -872,163 +4167,353 @@ static char * in_get_parameters(const struct audio_stream *stream,
     return str_parm;
 }
 
-static int in_set_gain(struct audio_stream_in *stream __unused, float gain __unused)
+static int in_set_gain(struct audio_stream_in *stream, float gain)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+    unsigned int q15 = gain_to_q15(gain);
+
+    ALOGV("%s : gain %f", __func__, gain);
+    atomic_store_explicit(&in->gain, gain_pack(q15, q15), memory_order_relaxed);
     return 0;
 }
 
+//[BT SCO VoIP Call
+/*
+ * must be called with input stream mutex locked. Copies the echo reference
+ * published since the last read, up to frames. A reader lapped by the writer
+ * resumes at the newest block.
+ */
+static size_t echo_ref_read(struct stream_in *in, int16_t *buffer, size_t frames)
+{
+    struct echo_ref *ref = &in->dev->echo_ref;
+    size_t done = 0;
+
+    while (done < frames) {
+        uint64_t seq = atomic_load_explicit(&ref->seq, memory_order_acquire);
+        struct echo_ref_block *block;
+        uint64_t gen;
+        uint32_t count;
+        int64_t play_ns;
+        size_t n = 0;
+
+        if (in->ref_seq >= seq)
+            break;
+        if (seq - in->ref_seq >= ECHO_REF_BLOCKS) {
+            ALOGV("%s : lapped, skipping %" PRIu64 " blocks", __func__, seq - 1 - in->ref_seq);
+            in->ref_seq = seq - 1;
+            in->ref_offset = 0;
+        }
+
+        block = &ref->blocks[in->ref_seq % ECHO_REF_BLOCKS];
+        /* already being refilled: seq has moved on, the next pass skips ahead */
+        gen = atomic_load_explicit(&block->gen, memory_order_acquire);
+        if (gen != 2 * in->ref_seq + 2)
+            continue;
+        count = block->frames;
+        play_ns = block->play_ns;
+        /* a block being rewritten may hold anything, it is dropped below */
+        if (count > ECHO_REF_BLOCK_FRAMES)
+            count = ECHO_REF_BLOCK_FRAMES;
+        if (in->ref_offset < count) {
+            n = count - in->ref_offset;
+            if (n > frames - done)
+                n = frames - done;
+            memcpy(buffer + done, block->data + in->ref_offset, n * sizeof(int16_t));
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&block->gen, memory_order_relaxed) != gen)
+            continue;
+
+        in->ref_offset += n;
+        in->ref_next_ns = play_ns + frames_to_ns(in->ref_offset, BT_SCO_SAMPLING_RATE);
+        done += n;
+        if (in->ref_offset >= count) {
+            in->ref_seq++;
+            in->ref_offset = 0;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * Echo reference inputs never open a pcm. What the downlink has not produced
+ * by the time the buffer is due reads as silence, which keeps the stream
+ * running at 8 kHz between calls.
+ */
+static ssize_t echo_ref_in_read(struct stream_in *in, int16_t *buffer, size_t bytes)
+{
+    size_t frames = bytes / sizeof(int16_t);
+    int64_t deadline_ns = 0;
+    size_t got;
+
+    pthread_mutex_lock(&in->lock);
+    got = echo_ref_read(in, buffer, frames);
+    if (got < frames) {
+        deadline_ns = stream_pacer_advance(&in->pacer, frames, BT_SCO_SAMPLING_RATE);
+        pthread_mutex_unlock(&in->lock);
+        stream_pacer_sleep_until(deadline_ns);
+        pthread_mutex_lock(&in->lock);
+        got += echo_ref_read(in, buffer + got, frames - got);
+        memset(buffer + got, 0, (frames - got) * sizeof(int16_t));
+    } else {
+        stream_pacer_reset(&in->pacer);
+    }
+    in->frames_read += frames;
+    in->frames_captured += frames;
+    stats_add(&in->stats.bytes, bytes);
+    stats_add(&in->stats.frames, frames);
+    pthread_mutex_unlock(&in->lock);
+
+    return bytes;
+}
+//BT SCO VoIP Call]
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
     int ret = 0;
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
+    unsigned int ctl;
+    int64_t deadline_ns = 0;
+    int64_t wait_start;
+    size_t frame_size = audio_stream_in_frame_size(stream);
+    size_t filled = 0; /* frames in buffer that came from the card */
 
     ALOGV("%s : bytes_requested : %zu", __func__, bytes);
 
-    /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the input stream mutex - e.g.
-     * executing in_set_parameters() while holding the hw device
-     * mutex
-     */
-    pthread_mutex_lock(&adev->lock);
-    pthread_mutex_lock(&in->lock);
+    /* mmap clients read from the DMA ring directly */
+    if (in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ)
+        return -ENOSYS;
 
-    if(adev->in_needs_standby) {
-        do_in_standby(in);
-        adev->in_needs_standby = false;
-    }
+//[BT SCO VoIP Call
+    if (in->echo_ref)
+        return echo_ref_in_read(in, (int16_t *)buffer, bytes);
+//BT SCO VoIP Call]
 
-    if (in->standby) {
-        if(!adev->is_hfp_call_active) {
-            ret = start_input_stream(in);
-        } else {
-            ret = -1;
+    pthread_mutex_lock(&in->lock);
+    ctl = atomic_load_explicit(&adev->ctl_state, memory_order_acquire);
+    if (!in->standby && ctl == in->ctl_state) {
+        atomic_fetch_add_explicit(&adev->ctl_fast_path_count, 1, memory_order_relaxed);
+    } else {
+        /*
+         * acquiring hw device mutex is useful if a low priority thread
+         * is waiting on the input stream mutex - e.g. executing
+         * in_set_parameters() while holding the hw device mutex.
+         * Such paths publish a new control state first, which is what
+         * sends us here.
+         */
+        pthread_mutex_unlock(&in->lock);
+        atomic_fetch_add_explicit(&adev->ctl_slow_path_count, 1, memory_order_relaxed);
+        wait_start = monotonic_ns();
+        pthread_mutex_lock(&adev->lock);
+        stats_record_lock_wait(&in->stats, monotonic_ns() - wait_start);
+        pthread_mutex_lock(&in->lock);
+
+        if(adev->in_needs_standby) {
+            do_in_standby(in);
+            adev->in_needs_standby = false;
+            publish_ctl_state(adev);
+        }
+        /* the hub only reads the primary card, calls move every stream off it */
+        if (in->hubbed && (adev->in_sco_voip_call || adev->is_hfp_call_active))
+            do_in_standby(in);
+        /* only the stream on the BT pcm runs the SCO path, see release_sco_resources() */
+        if (!in->standby && (adev->sco_in == in) != adev->in_sco_voip_call)
+            do_in_standby(in);
+
+        if (in->standby) {
+            if(!adev->is_hfp_call_active) {
+                ret = start_input_stream(in);
+            } else {
+                ret = -1;
+            }
+            if (ret == 0)
+                in->standby = 0;
         }
-        if (ret == 0)
-            in->standby = 0;
+        ctl = atomic_load_explicit(&adev->ctl_state, memory_order_relaxed);
+        in->ctl_state = ctl;
+        pthread_mutex_unlock(&adev->lock);
     }
-    pthread_mutex_unlock(&adev->lock);
 
     if (ret < 0)
         goto exit;
 
 //[BT SCO VoIP Call
-    if(adev->in_sco_voip_call) {
-        /* VoIP pcm read from bt alsa card */
-        size_t frames_out = round_to_16_mult(in->pcm_config->period_size);
+    if(ctl & CTL_SCO_VOIP_CALL) {
+        /*
+         * VoIP pcm read from bt alsa card, a BT period at a time. Converted
+         * frames the client did not ask for stay in the scratch buffer for
+         * the next read, so any buffer size is filled exactly.
+         */
+        struct sco_scratch *scratch = &adev->sco_in_scratch;
         size_t frames_in = round_to_16_mult(bt_in_config.period_size);
-        size_t buf_size_out = in->pcm_config->channels * frames_out * SAMPLE_SIZE_IN_BYTES;
         size_t buf_size_in = bt_in_config.channels * frames_in * SAMPLE_SIZE_IN_BYTES;
-        size_t buf_size_remapped = in->pcm_config->channels * frames_in * SAMPLE_SIZE_IN_BYTES;
-        int16_t *buf_out = (int16_t *) malloc (buf_size_out);
-        int16_t *buf_in = (int16_t *) malloc (buf_size_in);
-        int16_t *buf_remapped = (int16_t *) malloc (buf_size_remapped);
-
-        if(adev->voip_in_resampler == NULL) {
-            int ret = create_resampler(bt_in_config.rate /*src rate*/, in->pcm_config->rate /*dst rate*/, in->pcm_config->channels/*dst channels*/,
-                        RESAMPLER_QUALITY_DEFAULT, NULL, &(adev->voip_in_resampler));
-            ALOGV("%s : bytes_requested : %zu", __func__, bytes);
-            ALOGV("%s : frames_in %zu frames_out %zu",__func__, frames_in, frames_out);
-            ALOGD("%s : size_in %zu size_out %zu size_remapped %zu", __func__, buf_size_in, buf_size_out, buf_size_remapped);
-            if (ret != 0) {
-                adev->voip_in_resampler = NULL;
-                ALOGE("%s : Failure to create resampler %d", __func__, ret);
-
-                free(buf_in);
-                free(buf_out);
-                free(buf_remapped);
-                goto exit;
-            } else {
-                ALOGD("%s : voip_in_resampler created rate : [%d -> %d]", __func__, bt_in_config.rate, in->pcm_config->rate);
-            }
+        size_t frames = bytes / frame_size;
+        size_t hw_frames = 0;
+        size_t done = 0;
+        int16_t *buf_out = scratch->buf_out;
+        int16_t *buf_in;
+
+        if (scratch->base == NULL || frames_in > sco_uplink_max_input(&adev->voip_uplink)) {
+            ALOGE("%s : sco scratch buffers not available", __func__);
+            ret = -ENOMEM;
+            goto exit;
         }
 
-        memset(buf_in, 0, buf_size_in);
-        memset(buf_remapped, 0, buf_size_remapped);
-        memset(buf_out, 0, buf_size_out);
+        while (done < frames) {
+            size_t n;
 
-        ret = pcm_read(in->pcm, buf_in, buf_size_in);
+            if (in->sco_avail == 0) {
+                /* read straight into the interpolator's input line */
+                buf_in = sco_uplink_input(&adev->voip_uplink);
+                ret = stats_pcm_read(&in->stats, in->pcm, buf_in, buf_size_in);
+                if (ret != 0)
+                    break;
+                hw_frames += frames_in;
 
-#ifdef DEBUG_PCM_DUMP
-        if(sco_call_read != NULL) {
-            fwrite(buf_in, 1, buf_size_in, sco_call_read);
-        } else {
-            ALOGD("%s : sco_call_read was NULL, no dump", __func__);
-        }
-#endif
-        adjust_channels(buf_in, bt_in_config.channels, buf_remapped, in->pcm_config->channels, 
-                                        SAMPLE_SIZE_IN_BYTES, buf_size_in);
+                pcm_dump_write(adev->dump_taps[DUMP_SCO_CALL_READ], buf_in, buf_size_in,
+                        bt_in_config.rate, bt_in_config.channels);
 
-        //ALOGV("%s : remapping : [%d -> %d]", __func__, bt_in_config.channels, in->pcm_config->channels);
+                in->sco_avail = sco_uplink_process(&adev->voip_uplink, frames_in, buf_out);
+                in->sco_avail = in_convert(in, buf_out, in->sco_avail);
+                in->sco_offset = 0;
 
-#ifdef DEBUG_PCM_DUMP
-        if(sco_call_read_remapped != NULL) {
-            fwrite(buf_remapped, 1, buf_size_remapped, sco_call_read_remapped);
-        } else {
-            ALOGD("%s : sco_call_read_remapped was NULL, no dump", __func__);
-        }
-#endif
+                ALOGV("%s : frames_in %zu frames_out %zu",__func__, frames_in, in->sco_avail);
+                continue;
+            }
 
-        if(adev->voip_in_resampler != NULL) {
-            adev->voip_in_resampler->resample_from_input(adev->voip_in_resampler, (int16_t *)buf_remapped, (size_t *)&frames_in, (int16_t *) buf_out, (size_t *)&frames_out);
-            //ALOGV("%s : upsampling [%d -> %d]",__func__, bt_in_config.rate, in->pcm_config->rate);
+            n = frames - done;
+            if (n > in->sco_avail)
+                n = in->sco_avail;
+            memcpy((char *)buffer + done * frame_size,
+                    (const char *)buf_out + in->sco_offset * frame_size, n * frame_size);
+            in->sco_offset += n;
+            in->sco_avail -= n;
+            done += n;
         }
 
-        ALOGV("%s : modified frames_in %zu frames_out %zu",__func__, frames_in, frames_out);
+        pcm_dump_write(adev->dump_taps[DUMP_SCO_CALL_READ_BT], buffer, done * frame_size,
+                in_get_sample_rate(&stream->common), popcount(in->req_config.channel_mask));
 
-        buf_size_out = in->pcm_config->channels * frames_out * SAMPLE_SIZE_IN_BYTES;
-        bytes = buf_size_out;
-
-#ifdef DEBUG_PCM_DUMP
-        if(sco_call_read_bt != NULL) {
-            fwrite(buf_out, 1, buf_size_out, sco_call_read_bt);
+        if (ret == 0) {
+            update_capture_timeline(in, hw_frames, frames);
         } else {
-            ALOGD("%s : sco_call_read_bt was NULL, no dump", __func__);
+            /* what was read before the error still reaches the client */
+            in->frames_read += done;
+            in->frames_captured += done;
+            in->hw_frames += hw_frames;
+            filled = done;
         }
-#endif
-
-        memcpy(buffer, buf_out, buf_size_out);
-
-        free(buf_in);
-        free(buf_out);
-        free(buf_remapped);
 //BT SCO VoIP Call]
     } else {
         /* pcm read for primary card */
-        ret = pcm_read(in->pcm, buffer, bytes);
-
-#ifdef DEBUG_PCM_DUMP
-        if(in_read_dump != NULL) {
-            fwrite(buffer, 1, bytes, in_read_dump);
+        if (in->conv_buf != NULL) {
+            ret = in_read_converted(in, (int16_t *)buffer,
+                    bytes / audio_stream_in_frame_size(stream));
         } else {
-            ALOGD("%s : in_read_dump was NULL, no dump", __func__);
+            ret = in_read_card(in, buffer, bytes);
+            if (ret == 0)
+                update_capture_timeline(in,
+                        bytes / (in->pcm_config->channels * SAMPLE_SIZE_IN_BYTES),
+                        bytes / audio_stream_in_frame_size(stream));
         }
-#endif
+
+        pcm_dump_write(in->dump_tap, buffer, bytes,
+                in_get_sample_rate(&stream->common), popcount(in->req_config.channel_mask));
     }
     if (ret > 0)
         ret = 0;
 
     /*
-     * Instead of writing zeroes here, we could trust the hardware
+     * Instead of ramping to zero here, we could trust the hardware
      * to always provide zeroes when muted.
      */
-    if (ret == 0 && adev->mic_mute)
-        memset(buffer, 0, bytes);
+    if (ret == 0)
+        filled = bytes / frame_size;
+    if (filled > 0) {
+        unsigned int gain = adev->mic_mute ? 0 :
+                atomic_load_explicit(&in->gain, memory_order_relaxed);
+
+        if (!gain_is_unity(&in->gain_ramp, gain))
+            gain_apply(&in->gain_ramp, gain, (int16_t *)buffer, filled,
+                    popcount(in->req_config.channel_mask),
+                    GAIN_RAMP_MS * in_get_sample_rate(&stream->common) / 1000);
+        stats_add(&in->stats.bytes, filled * frame_size);
+        stats_add(&in->stats.frames, filled);
+    }
 
 exit:
+    if (ret < 0) {
+        size_t missing = bytes / frame_size - filled;
+
+        /* the client gets silence in place of what could not be captured */
+        memset((char *)buffer + filled * frame_size, 0, bytes - filled * frame_size);
+        in->frames_read += missing;
+        in->frames_captured += missing;
+        count_lost_input_frames(in, missing);
+        deadline_ns = stream_pacer_advance(&in->pacer, missing,
+                in_get_sample_rate(&stream->common));
+    } else {
+        stream_pacer_reset(&in->pacer);
+    }
     pthread_mutex_unlock(&in->lock);
     if (ret < 0)
-        usleep(bytes * 1000000 / audio_stream_in_frame_size(stream) /
-               in_get_sample_rate(&stream->common));
+        stream_pacer_sleep_until(deadline_ns);
 
     return bytes;
 }
 
-static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream __unused)
+static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+    uint32_t lost;
+
+    pthread_mutex_lock(&in->lock);
+    lost = in->frames_lost;
+    in->frames_lost = 0;
+    pthread_mutex_unlock(&in->lock);
+
+    return lost;
+}
+
+static int in_get_capture_position(const struct audio_stream_in *stream,
+                                   int64_t *frames, int64_t *time)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+    int ret = -ENOSYS;
+
+    if (frames == NULL || time == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&in->lock);
+//[BT SCO VoIP Call
+    /* the next frame read is the one that reached the card at ref_next_ns */
+    if (in->echo_ref && in->ref_next_ns != 0) {
+        *frames = in->frames_read;
+        *time = in->ref_next_ns;
+        ret = 0;
+    }
+//BT SCO VoIP Call]
+    if (in->hubbed) {
+        ret = in_hub_position(in, frames, time);
+    } else if (in->pcm != NULL && !(in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ)) {
+        unsigned int avail;
+        struct timespec ts;
+
+        if (pcm_get_htimestamp(in->pcm, &avail, &ts) == 0) {
+            /* frames waiting in the card, in client frames */
+            *frames = in->frames_captured + in->sco_avail +
+                    (uint64_t)avail * in->req_config.sample_rate / in->pcm_rate;
+            *time = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    return ret;
 }
 
 static int in_add_audio_effect(const struct audio_stream *stream __unused,
@@ -1043,9 +4528,140 @@ static int in_remove_audio_effect(const struct audio_stream *stream __unused,
     return 0;
 }
 
+static int in_start(const struct audio_stream_in *stream)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+    int ret = -ENOSYS;
+
+    ALOGV("%s",__func__);
+    pthread_mutex_lock(&in->lock);
+    if ((in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) && in->pcm != NULL) {
+        ret = 0;
+        if (pcm_start(in->pcm) < 0) {
+            ALOGE("%s : pcm_start failed: %s", __func__, pcm_get_error(in->pcm));
+            ret = -EIO;
+        }
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    return ret;
+}
+
+static int in_stop(const struct audio_stream_in *stream)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+    int ret = -ENOSYS;
+
+    ALOGV("%s",__func__);
+    pthread_mutex_lock(&in->lock);
+    if ((in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) && in->pcm != NULL) {
+        ret = 0;
+        if (pcm_stop(in->pcm) < 0) {
+            ALOGE("%s : pcm_stop failed: %s", __func__, pcm_get_error(in->pcm));
+            ret = -EIO;
+        }
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    return ret;
+}
+
+static int in_create_mmap_buffer(const struct audio_stream_in *stream,
+                                 int32_t min_size_frames,
+                                 struct audio_mmap_buffer_info *info)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+    struct audio_device *adev = in->dev;
+    int64_t open_start;
+    int ret = 0;
+
+    ALOGD("%s : min_size_frames %d", __func__, min_size_frames);
+
+    if (info == NULL || min_size_frames <= 0 ||
+            !(in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ))
+        return -EINVAL;
+
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&in->lock);
+
+    if (!in->standby) {
+        ALOGE("%s : mmap buffer already created", __func__);
+        ret = -EBUSY;
+        goto exit;
+    }
+
+    if (adev->is_hfp_call_active || adev->in_sco_voip_call) {
+        ALOGE("%s : not available during a call", __func__);
+        ret = -ENOSYS;
+        goto exit;
+    }
+
+    open_start = monotonic_ns();
+    in->pcm = open_mmap_pcm(adev->cardc, PCM_DEVICE, PCM_IN, in->pcm_config, min_size_frames, info);
+    stats_record_open(&in->stats, monotonic_ns() - open_start);
+    if (in->pcm == NULL) {
+        ret = -ENODEV;
+        goto exit;
+    }
+
+    in->standby = false;
+    adev->active_in = in;
+
+    /* force mixer updates */
+    select_devices(adev);
+
+exit:
+    pthread_mutex_unlock(&in->lock);
+    pthread_mutex_unlock(&adev->lock);
+
+    return ret;
+}
+
+/*
+ * The hw pointer and its timestamp come from the same status sync that
+ * pcm_get_htimestamp() does. Its avail is counted from the application
+ * pointer, which a mmap client never moves, so it saturates at the buffer
+ * size and cannot be used as the capture position.
+ */
+static int in_get_mmap_position(const struct audio_stream_in *stream,
+                                struct audio_mmap_position *position)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+    int ret = -ENOSYS;
+
+    if (position == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&in->lock);
+    if ((in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) && in->pcm != NULL)
+        ret = get_mmap_position(in->pcm, position);
+    pthread_mutex_unlock(&in->lock);
+
+    return ret;
+}
+
+/*
+ * MMAP_NOIRQ clients get the DMA ring as is, so they must ask for the format
+ * it is in; 0 fields take the ring's. Fills config with that format and
+ * returns false when the request asked for another one.
+ */
+static bool mmap_config_supported(struct audio_config *config, const struct pcm_config *pcm,
+                                  audio_channel_mask_t channel_mask)
+{
+    bool supported = (config->sample_rate == 0 || config->sample_rate == pcm->rate) &&
+            (config->channel_mask == AUDIO_CHANNEL_NONE ||
+             config->channel_mask == channel_mask) &&
+            (config->format == AUDIO_FORMAT_DEFAULT ||
+             config->format == AUDIO_FORMAT_PCM_16_BIT);
+
+    config->sample_rate = pcm->rate;
+    config->channel_mask = channel_mask;
+    config->format = AUDIO_FORMAT_PCM_16_BIT;
+    return supported;
+}
 
 static int adev_open_output_stream(struct audio_hw_device *dev,
-                                   audio_io_handle_t handle __unused,
+                                   audio_io_handle_t handle,
                                    audio_devices_t devices __unused,
                                    audio_output_flags_t flags,
                                    struct audio_config *config,
@@ -1058,38 +4674,30 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     struct audio_device *adev = (struct audio_device *)dev;
     struct stream_out *out;
     struct pcm_params *params;
+    char tap_name[PCM_DUMP_NAME_MAX];
 
     int ret;
 
-    adev->card = get_pcm_card("PCH");
-    if (adev->card != -1)
-        params = pcm_params_get(adev->card, PCM_DEVICE, PCM_OUT);
-    else {
-        adev->card = get_pcm_card("Intel");
-        if (adev->card != -1)
-            params = pcm_params_get(adev->card, PCM_DEVICE, PCM_OUT);
-	else {
-            adev->card = get_pcm_card("sofhdadsp");
-            if (adev->card != -1)
-                params = pcm_params_get(adev->card, PCM_DEVICE, PCM_OUT);
-            else {
-                adev->card = get_pcm_card("Dummy");
-                params = pcm_params_get(adev->card, PCM_DEVICE, PCM_OUT);
-            }
-        }
+    if ((flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) &&
+            !mmap_config_supported(config, &pcm_config_out_mmap, AUDIO_CHANNEL_OUT_STEREO)) {
+        ALOGW("%s : mmap playback is only available as %u Hz stereo 16 bit", __func__,
+                pcm_config_out_mmap.rate);
+        return -EINVAL;
     }
 
+    pthread_mutex_lock(&adev->lock);
+    primary_cards_sync(&adev->cards);
+    adev->card = adev->cards.card_out;
+    params = adev->cards.params_out;
     if (!params) {
-        adev->card = get_pcm_card("Dummy");
-        params = pcm_params_get(adev->card, PCM_DEVICE, PCM_OUT);
-        if (!params)
-            return -ENOSYS;
+        pthread_mutex_unlock(&adev->lock);
+        return -ENOSYS;
     }
 
     ALOGI("PCM playback card selected = %d, \n", adev->card);
     out = (struct stream_out *)calloc(1, sizeof(struct stream_out));
     if (!out) {
-        free(params);
+        pthread_mutex_unlock(&adev->lock);
         return -ENOMEM;
     }
 
@@ -1111,10 +4719,60 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
     out->stream.get_presentation_position = out_get_presentation_position;
-
-    out->pcm_config = &pcm_config_out;
+    out->stream.start = out_start;
+    out->stream.stop = out_stop;
+    out->stream.create_mmap_buffer = out_create_mmap_buffer;
+    out->stream.get_mmap_position = out_get_mmap_position;
+
+    if (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) {
+        ALOGI("%s : using mmap profile", __func__);
+        memcpy(&out->config, &pcm_config_out_mmap, sizeof(out->config));
+        out->pcm_config = &out->config;
+    } else if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        ALOGI("%s : using low latency profile", __func__);
+        out->pcm_config = &pcm_config_out_fast;
+    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        init_deep_buffer_config(&out->config, params);
+        out->pcm_config = &out->config;
+    } else {
+        out->pcm_config = &pcm_config_out;
+    }
 
     out->written = 0;
+    out->flags = flags;
+    atomic_init(&out->volume, GAIN_PACKED_UNITY);
+    gain_ramp_init(&out->volume_ramp);
+
+    if (!(flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) && config->sample_rate != 0 &&
+            config->sample_rate != out->pcm_config->rate) {
+        if (popcount(config->channel_mask) == out->pcm_config->channels)
+            out->src = stream_src_create(config->sample_rate, out->pcm_config->rate,
+                    out->pcm_config->channels, OUT_SRC_CHUNK_FRAMES);
+        if (out->src != NULL)
+            out->src_buf = (int16_t *)calloc(stream_src_max_output(out->src),
+                    out->pcm_config->channels * SAMPLE_SIZE_IN_BYTES);
+        if (out->src_buf == NULL) {
+            ALOGW("%s : %u Hz is written to the card unconverted", __func__, config->sample_rate);
+            stream_src_destroy(out->src);
+            out->src = NULL;
+        }
+    }
+
+    /* card format frames only, the client must be converted or already at the card rate */
+    if (adev->out_mixer.thread_started && !(flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) &&
+            out->pcm_config->channels == 2 && popcount(config->channel_mask) == 2 &&
+            out->pcm_config->rate == pcm_config_out_mixer.rate &&
+            (out->src != NULL || config->sample_rate == out->pcm_config->rate) &&
+            mix_ring_alloc(&out->ring,
+                    out->pcm_config->period_size * out->pcm_config->period_count) != 0)
+        ALOGW("%s : no mixer ring, the stream opens the card directly", __func__);
+
+    if (!(flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ)) {
+        out->silence = calloc(out->pcm_config->period_size,
+                out->pcm_config->channels * SAMPLE_SIZE_IN_BYTES);
+        if (!out->silence)
+            ALOGW("%s : no silence buffer, underruns restart without prefill", __func__);
+    }
 
 // VTS : Device doesn't support mono channel or sample_rate other than 48000
 //       make a copy of requested config to feed it back if requested.
@@ -1124,13 +4782,16 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->standby = true;
     out->unavailable = false;
 
+    snprintf(tap_name, sizeof(tap_name), "out_write_%d", handle);
+    out->dump_tap = pcm_dump_tap_get(adev->dump, tap_name);
+
     config->format = out_get_format(&out->stream.common);
     config->channel_mask = out_get_channels(&out->stream.common);
     config->sample_rate = out_get_sample_rate(&out->stream.common);
 
     *stream_out = &out->stream;
 
-    free(params);
+    pthread_mutex_unlock(&adev->lock);
 
     return 0;
 }
@@ -1138,7 +4799,21 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 static void adev_close_output_stream(struct audio_hw_device *dev __unused,
                                      struct audio_stream_out *stream)
 {
-    out_standby(&stream->common);
+    struct stream_out *out = (struct stream_out *)stream;
+
+    pthread_mutex_lock(&out->dev->lock);
+    publish_ctl_state(out->dev);
+    pthread_mutex_lock(&out->lock);
+    do_out_standby(out);
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&out->dev->lock);
+
+    pcm_dump_tap_put(out->dev->dump, out->dump_tap);
+    free(out->silence);
+    free(out->ring.data);
+    free(out->gain_buf);
+    free(out->src_buf);
+    stream_src_destroy(out->src);
     free(stream);
 }
 
@@ -1147,6 +4822,7 @@ static void stop_existing_output_input(struct audio_device *adev){
     ALOGD("%s during call scenario", __func__);
     adev->in_needs_standby = true;
     adev->out_needs_standby = true;
+    publish_ctl_state(adev);
 }
 
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
@@ -1155,6 +4831,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 
     struct audio_device * adev = (struct audio_device *)dev;
     char value[32];
+    char dump_taps[PCM_DUMP_MAX_TAPS * PCM_DUMP_NAME_MAX];
     int ret;
     struct str_parms *parms;
 
@@ -1173,6 +4850,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         } else {
             adev->is_hfp_call_active = false;
         }
+        publish_ctl_state(adev);
         pthread_mutex_unlock(&adev->lock);
     }
 
@@ -1183,28 +4861,38 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         if (strcmp(value, "on") == 0){
             adev->in_sco_voip_call = true;
             stop_existing_output_input(adev);
+            /* BT card, filters and pcms are set up off this thread */
+            adev->sco_prep_pending = true;
+            if (adev->sco_prep_thread_started)
+                pthread_cond_broadcast(&adev->sco_prep_cond);
+            else
+                sco_prepare(adev);
         } else {
             adev->in_sco_voip_call = false;
             stop_existing_output_input(adev);
 
-            release_resampler(adev->voip_in_resampler);
-            adev->voip_in_resampler = NULL;
-            release_resampler(adev->voip_out_resampler);
-            adev->voip_out_resampler = NULL;
+            release_sco_resources(adev);
         }
         pthread_mutex_unlock(&adev->lock);
     }
 //BT SCO VoIP Call]
 
+    ret = str_parms_get_str(parms, PCM_DUMP_PARAMETER, dump_taps, sizeof(dump_taps));
+    if (ret >= 0)
+        pcm_dump_set_taps(adev->dump, dump_taps);
+
     str_parms_destroy(parms);
     return 0;
 }
 
-static char * adev_get_parameters(const struct audio_hw_device *dev __unused,
+static char * adev_get_parameters(const struct audio_hw_device *dev,
                                   const char *keys)
 {
     ALOGV("%s : keys : %s",__func__,keys);
+    struct audio_device *adev = (struct audio_device *)dev;
     struct str_parms *query = str_parms_create_str(keys);
+    struct str_parms *reply;
+    char *str_parm;
     char value[256];
     int ret;
 
@@ -1212,6 +4900,24 @@ static char * adev_get_parameters(const struct audio_hw_device *dev __unused,
         return NULL;
     }
 
+    if (str_parms_has_key(query, AUDIO_PARAMETER_JACK_OUT) ||
+            str_parms_has_key(query, AUDIO_PARAMETER_JACK_IN)) {
+        reply = str_parms_create();
+        if (reply == NULL) {
+            str_parms_destroy(query);
+            return NULL;
+        }
+        /* devices plugged into the jacks, in the routing parameter's format */
+        if (str_parms_has_key(query, AUDIO_PARAMETER_JACK_OUT))
+            str_parms_add_int(reply, AUDIO_PARAMETER_JACK_OUT, atomic_load(&adev->jack_out));
+        if (str_parms_has_key(query, AUDIO_PARAMETER_JACK_IN))
+            str_parms_add_int(reply, AUDIO_PARAMETER_JACK_IN, atomic_load(&adev->jack_in));
+        str_parm = str_parms_to_str(reply);
+        str_parms_destroy(reply);
+        str_parms_destroy(query);
+        return str_parm;
+    }
+
     ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_HW_AV_SYNC, value, sizeof(value));
     if (ret >= 0) {
         str_parms_destroy(query);
@@ -1249,28 +4955,84 @@ static int adev_set_voice_volume(struct audio_hw_device *dev __unused, float vol
     return ret;
 }
 
-static int adev_set_master_volume(struct audio_hw_device *dev __unused, float volume __unused)
+/*
+ * must be called with hw device mutex locked. Puts master volume and mute on
+ * the card controls where there are some and leaves the rest to out_write().
+ */
+static void update_master_gain(struct audio_device *adev)
+{
+    unsigned int gain = gain_to_q15(adev->master_volume);
+    unsigned int i;
+
+    if (adev->master_volume_ctl != NULL) {
+        int percent = (int)lrintf(adev->master_volume * 100.0f);
+
+        for (i = 0; i < mixer_ctl_get_num_values(adev->master_volume_ctl); i++)
+            mixer_ctl_set_percent(adev->master_volume_ctl, i, percent);
+        gain = GAIN_UNITY;
+    }
+
+    if (adev->master_mute_ctl != NULL) {
+        for (i = 0; i < mixer_ctl_get_num_values(adev->master_mute_ctl); i++)
+            mixer_ctl_set_value(adev->master_mute_ctl, i, !adev->master_mute);
+    } else if (adev->master_mute) {
+        gain = 0;
+    }
+
+    atomic_store_explicit(&adev->master_gain, gain_pack(gain, gain), memory_order_relaxed);
+}
+
+static int adev_set_master_volume(struct audio_hw_device *dev, float volume)
 {
     ALOGV("adev_set_master_volume: %f", volume);
-    return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
+
+    if (volume < 0.0f || volume > 1.0f)
+        return -EINVAL;
+
+    pthread_mutex_lock(&adev->lock);
+    adev->master_volume = volume;
+    update_master_gain(adev);
+    pthread_mutex_unlock(&adev->lock);
+
+    return 0;
 }
 
-static int adev_get_master_volume(struct audio_hw_device *dev __unused, float *volume __unused)
+static int adev_get_master_volume(struct audio_hw_device *dev, float *volume)
 {
     ALOGV("adev_get_master_volume:");
-    return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
+
+    pthread_mutex_lock(&adev->lock);
+    *volume = adev->master_volume;
+    pthread_mutex_unlock(&adev->lock);
+
+    return 0;
 }
 
-static int adev_set_master_mute(struct audio_hw_device *dev __unused, bool muted __unused)
+static int adev_set_master_mute(struct audio_hw_device *dev, bool muted)
 {
     ALOGV("adev_set_master_mute: %d", muted);
-    return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
+
+    pthread_mutex_lock(&adev->lock);
+    adev->master_mute = muted;
+    update_master_gain(adev);
+    pthread_mutex_unlock(&adev->lock);
+
+    return 0;
 }
 
-static int adev_get_master_mute(struct audio_hw_device *dev __unused, bool *muted __unused)
+static int adev_get_master_mute(struct audio_hw_device *dev, bool *muted)
 {
+    struct audio_device *adev = (struct audio_device *)dev;
+
+    pthread_mutex_lock(&adev->lock);
+    *muted = adev->master_mute;
+    pthread_mutex_unlock(&adev->lock);
+
     ALOGV("adev_get_master_mute: %d", *muted);
-    return -ENOSYS;
+    return 0;
 }
 static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
 {
@@ -1318,13 +5080,13 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev __unu
 }
 
 static int adev_open_input_stream(struct audio_hw_device *dev,
-                                  audio_io_handle_t handle __unused,
+                                  audio_io_handle_t handle,
                                   audio_devices_t devices __unused,
                                   struct audio_config *config,
                                   struct audio_stream_in **stream_in,
-                                  audio_input_flags_t flags __unused,
+                                  audio_input_flags_t flags,
                                   const char *address __unused,
-                                  audio_source_t source __unused)
+                                  audio_source_t source)
 
 {
     ALOGD("%s : requested config : [rate %d format %d channels %d flags %#x]",__func__,
@@ -1333,39 +5095,45 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     struct audio_device *adev = (struct audio_device *)dev;
     struct stream_in *in;
     struct pcm_params *params;
+    char tap_name[PCM_DUMP_NAME_MAX];
 
     *stream_in = NULL;
 
-    adev->cardc = get_pcm_card("PCH");
-    if (adev->cardc != -1)
-        params = pcm_params_get(adev->cardc, PCM_DEVICE, PCM_IN);
-    else {
-        adev->cardc = get_pcm_card("Intel");
-        if (adev->cardc != -1)
-            params = pcm_params_get(adev->cardc, PCM_DEVICE, PCM_IN);
-	else {
-            adev->cardc = get_pcm_card("sofhdadsp");
-            if (adev->cardc != -1)
-                params = pcm_params_get(adev->cardc, PCM_DEVICE, PCM_IN);
-            else {
-                adev->cardc = get_pcm_card("Dummy");
-                params = pcm_params_get(adev->cardc, PCM_DEVICE, PCM_IN);
-            }
-        }
+//[BT SCO VoIP Call
+    /* the echo reference is the SCO downlink as it leaves for the BT card */
+    if (source == AUDIO_SOURCE_ECHO_REFERENCE &&
+            (config->sample_rate != BT_SCO_SAMPLING_RATE ||
+             config->channel_mask != AUDIO_CHANNEL_IN_MONO ||
+             config->format != AUDIO_FORMAT_PCM_16_BIT ||
+             (flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ))) {
+        ALOGW("%s : echo reference is only available as 8 kHz mono 16 bit", __func__);
+        config->sample_rate = BT_SCO_SAMPLING_RATE;
+        config->channel_mask = AUDIO_CHANNEL_IN_MONO;
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        return -EINVAL;
     }
-    if(!params) {
-        adev->cardc = get_pcm_card("Dummy");
-        params = pcm_params_get(adev->cardc, PCM_DEVICE, PCM_IN);
-        if (!params)
-            return -ENOSYS;
+//BT SCO VoIP Call]
+
+    if ((flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) &&
+            !mmap_config_supported(config, &pcm_config_in_mmap, AUDIO_CHANNEL_IN_STEREO)) {
+        ALOGW("%s : mmap capture is only available as %u Hz stereo 16 bit", __func__,
+                pcm_config_in_mmap.rate);
+        return -EINVAL;
     }
+
+    pthread_mutex_lock(&adev->lock);
+    primary_cards_sync(&adev->cards);
+    adev->cardc = adev->cards.card_in;
+    params = adev->cards.params_in;
+    pthread_mutex_unlock(&adev->lock);
+    if (!params)
+        return -ENOSYS;
+
     ALOGI("PCM capture card selected = %d, \n", adev->cardc);
 
     in = (struct stream_in *)calloc(1, sizeof(struct stream_in));
-    if (!in) {
-        free(params);
+    if (!in)
         return -ENOMEM;
-    }
 
     in->stream.common.get_sample_rate = in_get_sample_rate;
     in->stream.common.set_sample_rate = in_set_sample_rate;
@@ -1382,34 +5150,156 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.set_gain = in_set_gain;
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
+    in->stream.get_capture_position = in_get_capture_position;
+    in->stream.start = in_start;
+    in->stream.stop = in_stop;
+    in->stream.create_mmap_buffer = in_create_mmap_buffer;
+    in->stream.get_mmap_position = in_get_mmap_position;
 
     in->dev = adev;
     in->standby = true;
-
-    in->pcm_config = &pcm_config_in; /* default PCM config */
+    in->flags = flags;
+    atomic_init(&in->gain, GAIN_PACKED_UNITY);
+    gain_ramp_init(&in->gain_ramp);
+
+    if (source == AUDIO_SOURCE_ECHO_REFERENCE) {
+        ALOGI("%s : echo reference input", __func__);
+        in->echo_ref = true;
+        in->ref_seq = atomic_load_explicit(&adev->echo_ref.seq, memory_order_acquire);
+        in->pcm_config = &bt_out_config;
+    } else if (flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) {
+        ALOGI("%s : using mmap profile", __func__);
+        memcpy(&in->config, &pcm_config_in_mmap, sizeof(in->config));
+        in->pcm_config = &in->config;
+    } else {
+        in->pcm_config = &pcm_config_in; /* default PCM config */
+    }
 
 // VTS : Device doesn't support mono channel or sample_rate other than 48000
 //       make a copy of requested config to feed it back if requested.
     memcpy(&in->req_config, config, sizeof(struct audio_config));
 
+    in->hub_capable = adev->in_hub.thread_started && !in->echo_ref &&
+            !(flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ);
+    /* assistants want what was said just before they got the mic */
+    if (in->hub_capable &&
+            (source == AUDIO_SOURCE_HOTWORD || source == AUDIO_SOURCE_VOICE_RECOGNITION))
+        in->preroll_ms = adev->in_hub.preroll_ms;
+
+    if (!(flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) && !in->echo_ref) {
+        unsigned int channels = popcount(config->channel_mask);
+        bool convert = false;
+
+        if (channels == 1 && in->pcm_config->channels == 2) {
+            in->fold_mono = true;
+            convert = true;
+        }
+        /* only decimation, a client rate above the card's is passed through */
+        if (config->sample_rate != 0 && config->sample_rate < in->pcm_config->rate &&
+                channels <= in->pcm_config->channels) {
+            in->src = stream_src_create(in->pcm_config->rate, config->sample_rate,
+                    channels, IN_CONV_CHUNK_FRAMES);
+            convert = convert || in->src != NULL;
+        }
+        if (convert)
+            in->conv_buf = (int16_t *)calloc(IN_CONV_CHUNK_FRAMES,
+                    in->pcm_config->channels * SAMPLE_SIZE_IN_BYTES);
+        if (convert && in->conv_buf == NULL) {
+            ALOGE("%s : out of memory, capture is not converted", __func__);
+            stream_src_destroy(in->src);
+            in->src = NULL;
+            in->fold_mono = false;
+        }
+    }
+
+    snprintf(tap_name, sizeof(tap_name), "in_read_%d", handle);
+    in->dump_tap = pcm_dump_tap_get(adev->dump, tap_name);
+
     *stream_in = &in->stream;
 
-    free(params);
     return 0;
 }
 
 static void adev_close_input_stream(struct audio_hw_device *dev __unused,
                                    struct audio_stream_in *stream)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+
     ALOGV("adev_close_input_stream...");
 
     in_standby(&stream->common);
+    pcm_dump_tap_put(in->dev->dump, in->dump_tap);
+    free(in->conv_buf);
+    stream_src_destroy(in->src);
     free(stream);
 }
 
-static int adev_dump(const audio_hw_device_t *device __unused, int fd __unused)
+static int adev_dump(const audio_hw_device_t *device, int fd)
 {
     ALOGV("adev_dump");
+    struct audio_device *adev = (struct audio_device *)device;
+    uint64_t fast = atomic_load_explicit(&adev->ctl_fast_path_count, memory_order_relaxed);
+    uint64_t slow = atomic_load_explicit(&adev->ctl_slow_path_count, memory_order_relaxed);
+
+    unsigned int r;
+
+    dprintf(fd, "\nPrimary audio module:\n");
+    dprintf(fd, "  control state: %#x, buffers on fast path %" PRIu64 ", on slow path %" PRIu64 "\n",
+            atomic_load_explicit(&adev->ctl_state, memory_order_relaxed), fast, slow);
+
+    if (pthread_mutex_trylock(&adev->lock) != 0) {
+        dprintf(fd, "  Could not obtain device lock.\n");
+        return 0;
+    }
+
+    dprintf(fd, "  cards: playback %d, capture %d, bt %d, mixer %d\n",
+            adev->card, adev->cardc, adev->bt_card, adev->cards.mixer_card);
+    dprintf(fd, "  devices: out %#x, in %#x, routes:", adev->out_device, adev->in_device);
+    for (r = 0; r < ROUTE_COUNT; r++) {
+        if (adev->routes & (1u << r))
+            dprintf(fd, " %s", route_path_names[r]);
+    }
+    dprintf(fd, "\n");
+    dprintf(fd, "  jacks: %s, out %#x, in %#x\n",
+            adev->jack_thread_started ? "followed" : "not followed",
+            atomic_load(&adev->jack_out), atomic_load(&adev->jack_in));
+    dprintf(fd, "  hfp call: %s, sco voip call: %s\n",
+            adev->is_hfp_call_active ? "active" : "off",
+            adev->in_sco_voip_call ? "active" : "off");
+    dprintf(fd, "  sco pcms prepared: out %s, in %s%s\n",
+            adev->sco_pcm_out != NULL ? "yes" : "no", adev->sco_pcm_in != NULL ? "yes" : "no",
+            adev->sco_prep_pending ? ", preparation pending" : "");
+    dprintf(fd, "  active output %p, active input %p\n", adev->active_out, adev->active_in);
+    dprintf(fd, "  mixable outputs playing %u, on the card alone %p, mmap %p\n",
+            adev->outs_playing, adev->out_direct, adev->out_mmap);
+    dprintf(fd, "  echo reference blocks published: %" PRIu64 "\n",
+            (uint64_t)atomic_load_explicit(&adev->echo_ref.seq, memory_order_relaxed));
+    dprintf(fd, "  master volume %.2f%s on %s\n", adev->master_volume,
+            adev->master_mute ? " (muted)" : "",
+            adev->master_volume_ctl != NULL ? "card" : "software");
+
+    if (adev->out_mixer.thread_started) {
+        struct out_mixer *mix = &adev->out_mixer;
+
+        pthread_mutex_lock(&mix->lock);
+        dprintf(fd, "  software mixer: %u streams, pcm %s, period %u x %u%s\n", mix->count,
+                mix->pcm != NULL ? "open" : "closed", mix->config.period_size,
+                mix->config.period_count, mix->retired != NULL ? ", card changing hands" :
+                mix->card_busy ? ", card taken" : "");
+        pthread_mutex_unlock(&mix->lock);
+        stats_dump(&mix->stats, fd, "pcm_write");
+    }
+    if (adev->in_hub.thread_started) {
+        struct in_hub *hub = &adev->in_hub;
+
+        pthread_mutex_lock(&hub->lock);
+        dprintf(fd, "  capture hub: %u streams, pcm %s, pre-roll %u ms\n", hub->count,
+                hub->pcm != NULL ? "open" : "closed", hub->preroll_ms);
+        pthread_mutex_unlock(&hub->lock);
+        stats_dump(&hub->stats, fd, "pcm_read");
+    }
+
+    pthread_mutex_unlock(&adev->lock);
     return 0;
 }
 
@@ -1429,34 +5319,20 @@ static int adev_close(hw_device_t *device)
 
     struct audio_device *adev = (struct audio_device *)device;
 
+    stop_jack_worker(adev);
+    stop_standby_worker(adev);
+    stop_sco_prep_worker(adev);
+    stop_out_mixer(adev);
+    stop_in_hub(adev);
+
     audio_route_free(adev->ar);
+    if (adev->mixer != NULL)
+        mixer_close(adev->mixer);
 
-#ifdef DEBUG_PCM_DUMP
-    if(sco_call_write != NULL) {
-        fclose(sco_call_write);
-    }
-    if(sco_call_write_remapped != NULL) {
-        fclose(sco_call_write_remapped);
-    }
-    if(sco_call_write_bt != NULL) {
-        fclose(sco_call_write_bt);
-    }
-    if(sco_call_read != NULL) {
-        fclose(sco_call_read);
-    }
-    if(sco_call_read_remapped != NULL) {
-        fclose(sco_call_read_remapped);
-    }
-    if(sco_call_read_bt != NULL) {
-        fclose(sco_call_read_bt);
-    }
-    if(out_write_dump != NULL) {
-        fclose(out_write_dump);
-    }
-    if(in_read_dump != NULL) {
-        fclose(in_read_dump);
-    }
-#endif
+    release_sco_resources(adev);
+    primary_cards_release(&adev->cards);
+
+    pcm_dump_destroy(adev->dump);
 
     free(device);
     return 0;
@@ -1469,6 +5345,7 @@ static int adev_open(const hw_module_t* module, const char* name,
 
     struct audio_device *adev;
     int card = 0;
+    int i;
     char mixer_path[PATH_MAX];
 
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
@@ -1479,7 +5356,7 @@ static int adev_open(const hw_module_t* module, const char* name,
         return -ENOMEM;
 
     adev->hw_device.common.tag = HARDWARE_DEVICE_TAG;
-    adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
+    adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_3_0;
     adev->hw_device.common.module = (struct hw_module_t *) module;
     adev->hw_device.common.close = adev_close;
     adev->hw_device.init_check = adev_init_check;
@@ -1501,13 +5378,9 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.dump = adev_dump;
     adev->hw_device.get_microphones = adev_get_microphones;
 
-    card = get_pcm_card("PCH");
-    if (card == -1 )
-       card = get_pcm_card("Intel");
-    if (card == -1 )
-       card = get_pcm_card("sofhdadsp");
-    if (card == -1 )
-       card = get_pcm_card("Dummy");
+    primary_cards_init(&adev->cards);
+    primary_cards_sync(&adev->cards);
+    card = adev->cards.mixer_card;
 
     snprintf(mixer_path,PATH_MAX,"/vendor/etc/mixer_paths_0.xml");
     adev->ar = audio_route_init(card, mixer_path);
@@ -1543,33 +5416,44 @@ static int adev_open(const hw_module_t* module, const char* name,
 
     adev->in_sco_voip_call = false;
     adev->is_hfp_call_active = false;
-    adev->voip_in_resampler = NULL;
-    adev->voip_out_resampler = NULL;
 //BT SCO VoIP Call]
 
     adev->in_needs_standby = false;
     adev->out_needs_standby = false;
+    publish_ctl_state(adev);
 
-#ifdef DEBUG_PCM_DUMP
-    sco_call_write = fopen("/vendor/dump/sco_call_write.pcm", "a");
-    sco_call_write_remapped = fopen("/vendor/dump/sco_call_write_remapped.pcm", "a");
-    sco_call_write_bt = fopen("/vendor/dump/sco_call_write_bt.pcm", "a");
-    sco_call_read = fopen("/vendor/dump/sco_call_read.pcm", "a");
-    sco_call_read_remapped = fopen("/vendor/dump/sco_call_read_remapped.pcm", "a");
-    sco_call_read_bt = fopen("/vendor/dump/sco_call_read_bt.pcm", "a");
-    out_write_dump = fopen("/vendor/dump/out_write_dump.pcm", "a");
-    in_read_dump = fopen("/vendor/dump/in_read_dump.pcm", "a");
-
-    if(sco_call_write == NULL || sco_call_write_remapped == NULL || sco_call_write_bt == NULL || sco_call_read == NULL || 
-            sco_call_read_bt == NULL || sco_call_read_remapped == NULL || out_write_dump == NULL || in_read_dump == NULL)
-        ALOGD("%s : failed to open dump files",__func__);
-    else
-        ALOGD("%s : success in opening dump files",__func__);
-#endif
+    adev->xrun_prefill = property_get_bool(OUT_XRUN_PREFILL_PROPERTY, true);
+
+    adev->master_volume = 1.0f;
+    adev->master_mute = false;
+    atomic_init(&adev->master_gain, GAIN_PACKED_UNITY);
+    adev->mixer = mixer_open(card);
+    if (adev->mixer != NULL) {
+        char ctl_name[PROPERTY_VALUE_MAX];
+
+        property_get(MASTER_VOLUME_CTL_PROPERTY, ctl_name, MASTER_VOLUME_CTL_DEFAULT);
+        adev->master_volume_ctl = mixer_get_ctl_by_name(adev->mixer, ctl_name);
+        property_get(MASTER_MUTE_CTL_PROPERTY, ctl_name, MASTER_MUTE_CTL_DEFAULT);
+        adev->master_mute_ctl = mixer_get_ctl_by_name(adev->mixer, ctl_name);
+    }
+    ALOGI("%s : master volume on %s, mute on %s", __func__,
+            adev->master_volume_ctl != NULL ? "card" : "software",
+            adev->master_mute_ctl != NULL ? "card" : "software");
+
+    start_standby_worker(adev);
+    start_sco_prep_worker(adev);
+    start_out_mixer(adev);
+    start_in_hub(adev);
+    start_jack_worker(adev);
+
+    adev->dump = pcm_dump_create(PCM_DUMP_DIR_DEFAULT, "primary");
+    for (i = 0; i < DUMP_TAP_COUNT; i++)
+        adev->dump_taps[i] = pcm_dump_tap_get(adev->dump, dump_tap_names[i]);
 
     return 0;
 
  error:
+    primary_cards_release(&adev->cards);
     free(adev);
     return -ENODEV;
 }
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <log/log.h>
+
+#include "mmap_pcm.h"
+
+struct pcm *open_mmap_pcm(unsigned int card, unsigned int device, unsigned int flags,
+                          struct pcm_config *config, int32_t min_size_frames,
+                          struct audio_mmap_buffer_info *info)
+{
+    struct pcm *pcm;
+    void *areas = NULL;
+    unsigned int offset = 0;
+    unsigned int frames = 0;
+    unsigned int period_count;
+
+    period_count = (min_size_frames + config->period_size - 1) / config->period_size;
+    if (period_count < MMAP_PERIOD_COUNT_MIN)
+        period_count = MMAP_PERIOD_COUNT_MIN;
+    else if (period_count > MMAP_PERIOD_COUNT_MAX)
+        period_count = MMAP_PERIOD_COUNT_MAX;
+    config->period_count = period_count;
+
+    ALOGV("%s : opening pcm [%u : %d] for config : [rate %d period %d count %d]", __func__,
+            card, device, config->rate, config->period_size, config->period_count);
+
+    pcm = pcm_open(card, device, flags | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC, config);
+    if (!pcm) {
+        ALOGE("%s : pcm_open failed: device not found", __func__);
+        return NULL;
+    } else if (!pcm_is_ready(pcm)) {
+        ALOGE("%s : pcm_open failed: %s", __func__, pcm_get_error(pcm));
+        goto error;
+    }
+
+    if (pcm_prepare(pcm) < 0) {
+        ALOGE("%s : pcm_prepare failed: %s", __func__, pcm_get_error(pcm));
+        goto error;
+    }
+
+    if (pcm_mmap_begin(pcm, &areas, &offset, &frames) < 0) {
+        ALOGE("%s : pcm_mmap_begin failed: %s", __func__, pcm_get_error(pcm));
+        goto error;
+    }
+
+    info->shared_memory_address = areas;
+    info->shared_memory_fd = pcm_get_poll_fd(pcm);
+    info->buffer_size_frames = pcm_get_buffer_size(pcm);
+    info->burst_size_frames = config->period_size;
+    memset(areas, 0, pcm_frames_to_bytes(pcm, info->buffer_size_frames));
+
+    if (pcm_mmap_commit(pcm, offset, frames) < 0) {
+        ALOGE("%s : pcm_mmap_commit failed: %s", __func__, pcm_get_error(pcm));
+        goto error;
+    }
+
+    ALOGD("%s : buffer_size_frames %d burst_size_frames %d", __func__,
+            info->buffer_size_frames, info->burst_size_frames);
+    return pcm;
+
+error:
+    pcm_close(pcm);
+    return NULL;
+}
+
+int get_mmap_position(struct pcm *pcm, struct audio_mmap_position *position)
+{
+    unsigned int hw_ptr;
+    struct timespec ts = { 0, 0 };
+
+    if (pcm_mmap_get_hw_ptr(pcm, &hw_ptr, &ts) < 0) {
+        ALOGE("%s : pcm_mmap_get_hw_ptr failed: %s", __func__, pcm_get_error(pcm));
+        return -EIO;
+    }
+
+    position->position_frames = (int32_t)hw_ptr;
+    position->time_nanoseconds = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    return 0;
+}
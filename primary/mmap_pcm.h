@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_MMAP_PCM_H
+#define AUDIO_MMAP_PCM_H
+
+#include <stdint.h>
+
+#include <hardware/audio.h>
+#include <tinyalsa/asoundlib.h>
+
+/* bounds of the DMA ring handed to an MMAP_NOIRQ client, in periods */
+#define MMAP_PERIOD_COUNT_MIN 32
+#define MMAP_PERIOD_COUNT_MAX 512
+
+/*
+ * Opens the card in MMAP_NOIRQ mode with enough periods for min_size_frames
+ * and describes the DMA ring shared with the client in info. The whole ring
+ * is handed over up front, the client then reads or writes it in place.
+ * config->period_count is updated with the count actually used.
+ */
+struct pcm *open_mmap_pcm(unsigned int card, unsigned int device, unsigned int flags,
+                          struct pcm_config *config, int32_t min_size_frames,
+                          struct audio_mmap_buffer_info *info);
+
+/* Hardware pointer of an mmap pcm and the time it was sampled. Returns 0 or -EIO. */
+int get_mmap_position(struct pcm *pcm, struct audio_mmap_position *position);
+
+#endif /* AUDIO_MMAP_PCM_H */
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <pthread.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "sco_fir.h"
+
+_Static_assert(SCO_FIR_TAPS % SCO_RESAMPLE_RATIO == 0,
+               "SCO FIR length must be a multiple of the resample ratio");
+_Static_assert(SCO_FIR_PHASE_TAPS % 16 == 0,
+               "FIR dot product kernels work on blocks of 16 samples");
+
+fir_dot_fn fir_dot_s16;
+
+int32_t fir_dot_s16_c(const int16_t *a, const int16_t *b, size_t n)
+{
+    int32_t acc = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        acc += a[i] * b[i];
+
+    return acc;
+}
+
+#if defined(__SSE2__)
+int32_t fir_dot_s16_sse2(const int16_t *a, const int16_t *b, size_t n)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i < n; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(va, vb));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("avx2")))
+int32_t fir_dot_s16_avx2(const int16_t *a, const int16_t *b, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    __m128i sum;
+    size_t i;
+
+    for (i = 0; i < n; i += 16) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+//[BT SCO VoIP Call
+/* Kaiser windowed sinc, fc = 3850 Hz at 48 kHz, beta = 6.5, Q14, unity DC gain */
+static const int16_t sco_fir_q14[SCO_FIR_TAPS] = {
+       -1,    -2,    -2,    -1,     0,     3,     6,     8,     9,     6,     1,    -8,
+      -17,   -24,   -26,   -20,    -6,    14,    37,    55,    61,    51,    23,   -20,
+      -67,  -107,  -126,  -112,   -62,    18,   112,   195,   243,   231,   150,     6,
+     -178,  -359,  -485,  -507,  -384,  -101,   329,   865,  1439,  1970,  2378,  2597,
+     2597,  2378,  1970,  1439,   865,   329,  -101,  -384,  -507,  -485,  -359,  -178,
+        6,   150,   231,   243,   195,   112,    18,   -62,  -112,  -126,  -107,   -67,
+      -20,    23,    51,    61,    55,    37,    14,    -6,   -20,   -26,   -24,   -17,
+       -8,     1,     6,     9,     8,     6,     3,     0,    -1,    -2,    -2,    -1,
+};
+
+/* sco_fir_q14 with every tap doubled, applied to interleaved stereo frames */
+static int16_t sco_fir_stereo[2 * SCO_FIR_TAPS] __attribute__((aligned(32)));
+/* sco_fir_q14 scaled by the ratio and split into reversed polyphase branches */
+static int16_t sco_fir_phase[SCO_RESAMPLE_RATIO][SCO_FIR_PHASE_TAPS] __attribute__((aligned(32)));
+//BT SCO VoIP Call]
+
+static pthread_once_t fir_kernel_once = PTHREAD_ONCE_INIT;
+
+static void fir_kernel_init(void)
+{
+    int k, p, t;
+
+    fir_dot_s16 = fir_dot_s16_c;
+#if defined(__SSE2__)
+    fir_dot_s16 = fir_dot_s16_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fir_dot_s16 = fir_dot_s16_avx2;
+#endif
+
+//[BT SCO VoIP Call
+    for (k = 0; k < SCO_FIR_TAPS; k++) {
+        sco_fir_stereo[2 * k] = sco_fir_q14[k];
+        sco_fir_stereo[2 * k + 1] = sco_fir_q14[k];
+    }
+    for (p = 0; p < SCO_RESAMPLE_RATIO; p++)
+        for (t = 0; t < SCO_FIR_PHASE_TAPS; t++)
+            sco_fir_phase[p][t] = SCO_RESAMPLE_RATIO *
+                    sco_fir_q14[p + SCO_RESAMPLE_RATIO * (SCO_FIR_PHASE_TAPS - 1 - t)];
+//BT SCO VoIP Call]
+}
+
+void fir_kernels_init(void)
+{
+    pthread_once(&fir_kernel_once, fir_kernel_init);
+}
+
+//[BT SCO VoIP Call
+void sco_downlink_init(struct sco_downlink *dl, int16_t *line, size_t line_frames)
+{
+    dl->line = line;
+    dl->line_frames = line_frames;
+    dl->pending = SCO_FIR_TAPS - 1;
+    memset(line, 0, dl->pending * 2 * sizeof(int16_t));
+}
+
+size_t sco_downlink_process(struct sco_downlink *dl, const int16_t *in,
+                            size_t frames, int16_t *out)
+{
+    size_t total, consumed, n;
+
+    if (frames > dl->line_frames - dl->pending) {
+        ALOGW("%s : dropping %zu frames", __func__, frames - (dl->line_frames - dl->pending));
+        frames = dl->line_frames - dl->pending;
+    }
+
+    memcpy(dl->line + 2 * dl->pending, in, frames * 2 * sizeof(int16_t));
+    total = dl->pending + frames;
+
+    for (n = 0; n * SCO_RESAMPLE_RATIO + SCO_FIR_TAPS <= total; n++) {
+        int32_t acc = fir_dot_s16(dl->line + 2 * n * SCO_RESAMPLE_RATIO,
+                                  sco_fir_stereo, 2 * SCO_FIR_TAPS);
+        /* one more bit of shift for the (L + R) / 2 downmix */
+        out[n] = fir_round_sat(acc, SCO_FIR_SHIFT + 1);
+    }
+
+    consumed = n * SCO_RESAMPLE_RATIO;
+    dl->pending = total - consumed;
+    memmove(dl->line, dl->line + 2 * consumed, dl->pending * 2 * sizeof(int16_t));
+
+    return n;
+}
+
+size_t sco_downlink_max_input(const struct sco_downlink *dl, size_t samples)
+{
+    size_t frames = samples * SCO_RESAMPLE_RATIO + SCO_FIR_TAPS - 1 - dl->pending;
+
+    if (frames > dl->line_frames - dl->pending)
+        frames = dl->line_frames - dl->pending;
+    return frames;
+}
+
+void sco_uplink_init(struct sco_uplink *ul, int16_t *line, size_t line_frames)
+{
+    ul->line = line;
+    ul->line_frames = line_frames;
+    memset(line, 0, (SCO_FIR_PHASE_TAPS - 1) * sizeof(int16_t));
+}
+
+size_t sco_uplink_process(struct sco_uplink *ul, size_t frames, int16_t *out)
+{
+    size_t n;
+    int p;
+
+    for (n = 0; n < frames; n++) {
+        for (p = 0; p < SCO_RESAMPLE_RATIO; p++) {
+            int16_t v = fir_round_sat(fir_dot_s16(ul->line + n, sco_fir_phase[p],
+                                                  SCO_FIR_PHASE_TAPS), SCO_FIR_SHIFT);
+            *out++ = v;
+            *out++ = v;
+        }
+    }
+
+    memmove(ul->line, ul->line + frames, (SCO_FIR_PHASE_TAPS - 1) * sizeof(int16_t));
+
+    return frames * SCO_RESAMPLE_RATIO;
+}
+//BT SCO VoIP Call]
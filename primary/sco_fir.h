@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_SCO_FIR_H
+#define AUDIO_SCO_FIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fixed point FIR helpers shared by the SCO and stream rate converters:
+ * Q14 taps against 16 bit samples, accumulated in 32 bits. n must be a
+ * multiple of 16.
+ */
+typedef int32_t (*fir_dot_fn)(const int16_t *a, const int16_t *b, size_t n);
+
+/* the fastest variant the CPU runs, set by fir_kernels_init() */
+extern fir_dot_fn fir_dot_s16;
+
+int32_t fir_dot_s16_c(const int16_t *a, const int16_t *b, size_t n);
+#if defined(__SSE2__)
+int32_t fir_dot_s16_sse2(const int16_t *a, const int16_t *b, size_t n);
+/* only when the CPU supports AVX2 */
+int32_t fir_dot_s16_avx2(const int16_t *a, const int16_t *b, size_t n);
+#endif
+
+/* Picks fir_dot_s16 and builds the SCO filter tables, once. */
+void fir_kernels_init(void);
+
+static inline int16_t fir_round_sat(int32_t acc, int shift)
+{
+    acc = (acc + (1 << (shift - 1))) >> shift;
+    if (acc > INT16_MAX)
+        return INT16_MAX;
+    if (acc < INT16_MIN)
+        return INT16_MIN;
+    return (int16_t)acc;
+}
+
+//[BT SCO VoIP Call
+/*
+ * Rate conversion between the primary card (48 kHz stereo) and the BT SCO
+ * card (8 kHz mono). The ratio is fixed, so instead of remapping channels and
+ * then running a generic resampler the conversion is done by one polyphase
+ * FIR specialized for it: the downlink folds the stereo downmix into the
+ * filter taps and only evaluates every SCO_RESAMPLE_RATIO-th output, the
+ * uplink evaluates one SCO_FIR_PHASE_TAPS long phase per output sample.
+ *
+ * All arithmetic is integer so the scalar and SIMD variants are bit exact,
+ * tests/sco_fir_test.c checks it.
+ */
+#define SCO_RESAMPLE_RATIO          6
+#define SCO_FIR_TAPS                96
+#define SCO_FIR_PHASE_TAPS          (SCO_FIR_TAPS / SCO_RESAMPLE_RATIO)
+#define SCO_FIR_SHIFT               14
+
+/* 48 kHz stereo -> 8 kHz mono */
+struct sco_downlink {
+    int16_t *line;          /* carried over frames followed by the new buffer */
+    size_t line_frames;     /* capacity of line in stereo frames */
+    size_t pending;         /* frames carried over from the previous buffer */
+};
+
+/* 8 kHz mono -> 48 kHz stereo */
+struct sco_uplink {
+    int16_t *line;          /* SCO_FIR_PHASE_TAPS - 1 history samples, then new input */
+    size_t line_frames;     /* capacity of line in samples */
+};
+
+void sco_downlink_init(struct sco_downlink *dl, int16_t *line, size_t line_frames);
+
+/*
+ * Converts |frames| 48 kHz stereo frames into |out|, which must have room for
+ * ceil(frames / SCO_RESAMPLE_RATIO) samples. Frames that do not complete an
+ * output sample are kept for the next call. Returns the number of samples
+ * written.
+ */
+size_t sco_downlink_process(struct sco_downlink *dl, const int16_t *in,
+                            size_t frames, int16_t *out);
+
+/* most input frames sco_downlink_process() takes without emitting more than samples */
+size_t sco_downlink_max_input(const struct sco_downlink *dl, size_t samples);
+
+void sco_uplink_init(struct sco_uplink *ul, int16_t *line, size_t line_frames);
+
+/* where the caller places new 8 kHz samples before sco_uplink_process() */
+static inline int16_t *sco_uplink_input(struct sco_uplink *ul)
+{
+    return ul->line + SCO_FIR_PHASE_TAPS - 1;
+}
+
+static inline size_t sco_uplink_max_input(const struct sco_uplink *ul)
+{
+    return ul->line_frames - (SCO_FIR_PHASE_TAPS - 1);
+}
+
+/*
+ * Converts |frames| samples placed at sco_uplink_input() into |out|, which
+ * must have room for frames * SCO_RESAMPLE_RATIO stereo frames. Returns the
+ * number of frames written.
+ */
+size_t sco_uplink_process(struct sco_uplink *ul, size_t frames, int16_t *out);
+//BT SCO VoIP Call]
+
+#endif /* AUDIO_SCO_FIR_H */
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host check of the MMAP_NOIRQ buffer and position math against a fake
+ * tinyalsa backend: period count clamping, the buffer description returned
+ * to the client, the ring being cleared and committed, error unwinding and
+ * the hardware pointer conversion.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mmap_pcm.h"
+
+#define TEST_CARD               1
+#define TEST_DEVICE             3
+#define TEST_PERIOD_SIZE        48
+#define TEST_POLL_FD            42
+
+enum fake_fail {
+    FAIL_NONE,
+    FAIL_OPEN,
+    FAIL_READY,
+    FAIL_PREPARE,
+    FAIL_BEGIN,
+    FAIL_COMMIT,
+    FAIL_HW_PTR,
+};
+
+struct pcm {
+    unsigned int card;
+    unsigned int device;
+    unsigned int flags;
+    struct pcm_config config;
+    void *ring;
+    unsigned int begin_offset;
+    unsigned int begin_frames;
+    unsigned int commit_offset;
+    unsigned int commit_frames;
+    bool prepared;
+};
+
+static struct {
+    enum fake_fail fail;
+    struct pcm *last;           /* last pcm opened, kept after close */
+    int closed;
+    unsigned int hw_ptr;
+    struct timespec tstamp;
+} fake;
+
+static int failures;
+
+#define EXPECT(cond) do {                                                  \
+        if (!(cond)) {                                                     \
+            printf("FAIL %s:%d: %s\n", __func__, __LINE__, #cond);          \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+/* fake tinyalsa, enough of it for mmap_pcm.c */
+
+struct pcm *pcm_open(unsigned int card, unsigned int device, unsigned int flags,
+                     struct pcm_config *config)
+{
+    struct pcm *pcm;
+
+    if (fake.fail == FAIL_OPEN)
+        return NULL;
+
+    pcm = calloc(1, sizeof(*pcm));
+    pcm->card = card;
+    pcm->device = device;
+    pcm->flags = flags;
+    pcm->config = *config;
+    pcm->ring = malloc(pcm_frames_to_bytes(pcm, pcm_get_buffer_size(pcm)));
+    /* stale data from a previous client */
+    memset(pcm->ring, 0x5a, pcm_frames_to_bytes(pcm, pcm_get_buffer_size(pcm)));
+    free(fake.last);
+    fake.last = pcm;
+    return pcm;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return fake.fail != FAIL_READY;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    if (fake.fail == FAIL_PREPARE)
+        return -EINVAL;
+    pcm->prepared = true;
+    return 0;
+}
+
+int pcm_mmap_begin(struct pcm *pcm, void **areas, unsigned int *offset, unsigned int *frames)
+{
+    if (fake.fail == FAIL_BEGIN || !pcm->prepared)
+        return -EBADFD;
+    *areas = pcm->ring;
+    *offset = pcm->begin_offset = 0;
+    *frames = pcm->begin_frames = pcm_get_buffer_size(pcm);
+    return 0;
+}
+
+int pcm_mmap_commit(struct pcm *pcm, unsigned int offset, unsigned int frames)
+{
+    if (fake.fail == FAIL_COMMIT)
+        return -EPIPE;
+    pcm->commit_offset = offset;
+    pcm->commit_frames = frames;
+    return 0;
+}
+
+int pcm_mmap_get_hw_ptr(struct pcm *pcm, unsigned int *hw_ptr, struct timespec *tstamp)
+{
+    if (fake.fail == FAIL_HW_PTR)
+        return -ENODEV;
+    *hw_ptr = fake.hw_ptr;
+    *tstamp = fake.tstamp;
+    return 0;
+}
+
+int pcm_get_poll_fd(struct pcm *pcm)
+{
+    return TEST_POLL_FD;
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->config.period_size * pcm->config.period_count;
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->config.channels * sizeof(int16_t);
+}
+
+const char *pcm_get_error(struct pcm *pcm)
+{
+    return "fake error";
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    free(pcm->ring);
+    pcm->ring = NULL;
+    fake.closed++;
+    return 0;
+}
+
+/* tests */
+
+static struct pcm_config test_config(void)
+{
+    struct pcm_config config = {
+        .channels = 2,
+        .rate = 48000,
+        .period_size = TEST_PERIOD_SIZE,
+        .period_count = MMAP_PERIOD_COUNT_MAX,
+        .format = PCM_FORMAT_S16_LE,
+    };
+    return config;
+}
+
+static void reset_fake(enum fake_fail fail)
+{
+    fake.fail = fail;
+    fake.closed = 0;
+}
+
+static bool ring_is_clear(struct pcm *pcm)
+{
+    const unsigned char *p = pcm->ring;
+    size_t i, n = pcm_frames_to_bytes(pcm, pcm_get_buffer_size(pcm));
+
+    for (i = 0; i < n; i++)
+        if (p[i] != 0)
+            return false;
+    return true;
+}
+
+static void check_open(int32_t min_size_frames, unsigned int expected_count)
+{
+    struct pcm_config config = test_config();
+    struct audio_mmap_buffer_info info;
+    struct pcm *pcm;
+
+    reset_fake(FAIL_NONE);
+    memset(&info, 0, sizeof(info));
+    pcm = open_mmap_pcm(TEST_CARD, TEST_DEVICE, PCM_OUT, &config, min_size_frames, &info);
+    EXPECT(pcm != NULL);
+    if (pcm == NULL)
+        return;
+
+    EXPECT(config.period_count == expected_count);
+    EXPECT(pcm->card == TEST_CARD && pcm->device == TEST_DEVICE);
+    EXPECT(pcm->flags == (PCM_OUT | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC));
+    EXPECT(pcm->config.period_count == expected_count);
+
+    EXPECT(info.shared_memory_address == pcm->ring);
+    EXPECT(info.shared_memory_fd == TEST_POLL_FD);
+    EXPECT(info.buffer_size_frames == (int32_t)(expected_count * TEST_PERIOD_SIZE));
+    EXPECT(info.burst_size_frames == TEST_PERIOD_SIZE);
+    EXPECT(info.buffer_size_frames >= min_size_frames ||
+           expected_count == MMAP_PERIOD_COUNT_MAX);
+
+    /* the whole ring is cleared and handed over in one commit */
+    EXPECT(ring_is_clear(pcm));
+    EXPECT(pcm->commit_offset == pcm->begin_offset);
+    EXPECT(pcm->commit_frames == pcm->begin_frames);
+    EXPECT(pcm->commit_frames == (unsigned int)info.buffer_size_frames);
+    EXPECT(fake.closed == 0);
+
+    pcm_close(pcm);
+}
+
+static void test_period_count(void)
+{
+    check_open(1, MMAP_PERIOD_COUNT_MIN);
+    check_open(TEST_PERIOD_SIZE * MMAP_PERIOD_COUNT_MIN, MMAP_PERIOD_COUNT_MIN);
+    check_open(TEST_PERIOD_SIZE * MMAP_PERIOD_COUNT_MIN + 1, MMAP_PERIOD_COUNT_MIN + 1);
+    check_open(TEST_PERIOD_SIZE * 100, 100);
+    check_open(TEST_PERIOD_SIZE * 100 - 1, 100);
+    check_open(TEST_PERIOD_SIZE * MMAP_PERIOD_COUNT_MAX, MMAP_PERIOD_COUNT_MAX);
+    check_open(TEST_PERIOD_SIZE * MMAP_PERIOD_COUNT_MAX + 1, MMAP_PERIOD_COUNT_MAX);
+    check_open(INT32_MAX / 2, MMAP_PERIOD_COUNT_MAX);
+}
+
+static void test_open_errors(void)
+{
+    static const enum fake_fail fails[] = {
+        FAIL_READY, FAIL_PREPARE, FAIL_BEGIN, FAIL_COMMIT,
+    };
+    struct pcm_config config = test_config();
+    struct audio_mmap_buffer_info info;
+    size_t i;
+
+    reset_fake(FAIL_OPEN);
+    EXPECT(open_mmap_pcm(TEST_CARD, TEST_DEVICE, PCM_IN, &config, 1, &info) == NULL);
+    EXPECT(fake.closed == 0);
+
+    /* any failure after pcm_open closes the pcm exactly once */
+    for (i = 0; i < sizeof(fails) / sizeof(fails[0]); i++) {
+        reset_fake(fails[i]);
+        EXPECT(open_mmap_pcm(TEST_CARD, TEST_DEVICE, PCM_IN, &config, 1, &info) == NULL);
+        EXPECT(fake.closed == 1);
+    }
+}
+
+static void test_position(void)
+{
+    struct pcm_config config = test_config();
+    struct audio_mmap_buffer_info info;
+    struct audio_mmap_position position;
+    struct pcm *pcm;
+
+    reset_fake(FAIL_NONE);
+    pcm = open_mmap_pcm(TEST_CARD, TEST_DEVICE, PCM_IN, &config, 1, &info);
+    EXPECT(pcm != NULL);
+    if (pcm == NULL)
+        return;
+
+    fake.hw_ptr = 123456;
+    fake.tstamp = (struct timespec){ 7, 250000000 };
+    EXPECT(get_mmap_position(pcm, &position) == 0);
+    EXPECT(position.position_frames == 123456);
+    EXPECT(position.time_nanoseconds == 7250000000LL);
+
+    /* the boundary is far past the ring size, the pointer is not wrapped to it */
+    fake.hw_ptr = 10 * (unsigned int)info.buffer_size_frames + 5;
+    fake.tstamp = (struct timespec){ 0, 999999999 };
+    EXPECT(get_mmap_position(pcm, &position) == 0);
+    EXPECT(position.position_frames == 10 * info.buffer_size_frames + 5);
+    EXPECT(position.time_nanoseconds == 999999999LL);
+
+    memset(&position, 0, sizeof(position));
+    fake.fail = FAIL_HW_PTR;
+    EXPECT(get_mmap_position(pcm, &position) == -EIO);
+    EXPECT(position.position_frames == 0 && position.time_nanoseconds == 0);
+
+    pcm_close(pcm);
+}
+
+int main(void)
+{
+    test_period_count();
+    test_open_errors();
+    test_position();
+
+    free(fake.last);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures != 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host check of the SCO rate converters: every FIR kernel the CPU runs must
+ * give the same output as the scalar one, for any split of the input into
+ * buffers. Also prints how fast each kernel converts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../sco_fir.h"
+
+#define TEST_SECONDS            10
+#define TEST_OUT_RATE           48000
+#define TEST_SCO_RATE           (TEST_OUT_RATE / SCO_RESAMPLE_RATIO)
+#define TEST_MAX_CHUNK          960     /* 20 ms at 48 kHz */
+#define TEST_DOT_ROUNDS         100000
+
+struct kernel {
+    const char *name;
+    fir_dot_fn fn;
+};
+
+static uint32_t rng_state = 0x12345678;
+
+/* xorshift32, fixed seed so a failure reproduces */
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void fill_random(int16_t *buf, size_t n)
+{
+    size_t i;
+
+    /* mostly full scale noise with some clipped runs to hit saturation */
+    for (i = 0; i < n; i++) {
+        uint32_t r = rng();
+        if ((r & 0xff) == 0)
+            buf[i] = (r & 0x100) ? INT16_MAX : INT16_MIN;
+        else
+            buf[i] = (int16_t)(r >> 16);
+    }
+}
+
+static size_t random_chunk(size_t max)
+{
+    return 1 + rng() % max;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t get_kernels(struct kernel *kernels)
+{
+    size_t n = 0;
+
+    kernels[n++] = (struct kernel){ "c", fir_dot_s16_c };
+#if defined(__SSE2__)
+    kernels[n++] = (struct kernel){ "sse2", fir_dot_s16_sse2 };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels[n++] = (struct kernel){ "avx2", fir_dot_s16_avx2 };
+    else
+        printf("avx2 not supported by this CPU, skipped\n");
+#endif
+    return n;
+}
+
+static int check_dot(const struct kernel *k)
+{
+    int16_t a[256], b[256];
+    int round;
+
+    for (round = 0; round < TEST_DOT_ROUNDS; round++) {
+        size_t n = 16 * (1 + rng() % 16);
+        int32_t expected, got;
+
+        fill_random(a, n);
+        fill_random(b, n);
+        /* keep the sum inside 32 bits like the filter taps do */
+        for (size_t i = 0; i < n; i++)
+            b[i] >>= 8;
+
+        expected = fir_dot_s16_c(a, b, n);
+        got = k->fn(a, b, n);
+        if (got != expected) {
+            printf("FAIL %s dot: n %zu, expected %d got %d\n", k->name, n, expected, got);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Runs the downlink over |frames| of |in| in random sized buffers (or in
+ * TEST_MAX_CHUNK ones when fixed is set) and returns the samples written.
+ */
+static size_t run_downlink(const int16_t *in, size_t frames, int16_t *out, int fixed,
+                           int64_t *elapsed_ns)
+{
+    /* room for a partial output sample on top of the history */
+    static int16_t line[2 * (SCO_FIR_TAPS + SCO_RESAMPLE_RATIO + TEST_MAX_CHUNK)];
+    struct sco_downlink dl;
+    size_t done = 0, written = 0;
+    int64_t start;
+
+    sco_downlink_init(&dl, line, sizeof(line) / sizeof(line[0]) / 2);
+    start = now_ns();
+    while (done < frames) {
+        size_t n = fixed ? TEST_MAX_CHUNK : random_chunk(TEST_MAX_CHUNK);
+
+        if (n > frames - done)
+            n = frames - done;
+        written += sco_downlink_process(&dl, in + 2 * done, n, out + written);
+        done += n;
+    }
+    *elapsed_ns = now_ns() - start;
+
+    return written;
+}
+
+/* same for the uplink, |frames| 8 kHz samples in, 48 kHz stereo frames out */
+static size_t run_uplink(const int16_t *in, size_t frames, int16_t *out, int fixed,
+                         int64_t *elapsed_ns)
+{
+    static int16_t line[SCO_FIR_PHASE_TAPS - 1 + TEST_MAX_CHUNK / SCO_RESAMPLE_RATIO];
+    struct sco_uplink ul;
+    size_t done = 0, written = 0;
+    int64_t start;
+
+    sco_uplink_init(&ul, line, sizeof(line) / sizeof(line[0]));
+    start = now_ns();
+    while (done < frames) {
+        size_t max = sco_uplink_max_input(&ul);
+        size_t n = fixed ? max : random_chunk(max);
+
+        if (n > frames - done)
+            n = frames - done;
+        memcpy(sco_uplink_input(&ul), in + done, n * sizeof(int16_t));
+        written += sco_uplink_process(&ul, n, out + 2 * written);
+        done += n;
+    }
+    *elapsed_ns = now_ns() - start;
+
+    return written;
+}
+
+static void report(const char *what, const char *kernel, int64_t elapsed_ns, size_t frames)
+{
+    double secs = elapsed_ns / 1e9;
+
+    printf("%-8s %-5s %8.2f ns/frame %10.1fx realtime\n", what, kernel,
+           (double)elapsed_ns / frames, secs > 0 ? TEST_SECONDS / secs : 0.0);
+}
+
+int main(void)
+{
+    const size_t dl_frames = TEST_SECONDS * TEST_OUT_RATE;
+    const size_t ul_frames = TEST_SECONDS * TEST_SCO_RATE;
+    struct kernel kernels[3];
+    size_t nkernels, k, ref_dl_len, ref_ul_len;
+    int16_t *dl_in, *dl_ref, *dl_out, *ul_in, *ul_ref, *ul_out;
+    int64_t elapsed;
+    int failed = 0;
+
+    fir_kernels_init();
+    nkernels = get_kernels(kernels);
+
+    dl_in = malloc(2 * dl_frames * sizeof(int16_t));
+    dl_ref = malloc(dl_frames * sizeof(int16_t));
+    dl_out = malloc(dl_frames * sizeof(int16_t));
+    ul_in = malloc(ul_frames * sizeof(int16_t));
+    ul_ref = malloc(2 * ul_frames * SCO_RESAMPLE_RATIO * sizeof(int16_t));
+    ul_out = malloc(2 * ul_frames * SCO_RESAMPLE_RATIO * sizeof(int16_t));
+    if (!dl_in || !dl_ref || !dl_out || !ul_in || !ul_ref || !ul_out) {
+        printf("FAIL out of memory\n");
+        return 1;
+    }
+    fill_random(dl_in, 2 * dl_frames);
+    fill_random(ul_in, ul_frames);
+
+    /* scalar output in fixed buffers is the reference */
+    fir_dot_s16 = fir_dot_s16_c;
+    ref_dl_len = run_downlink(dl_in, dl_frames, dl_ref, 1, &elapsed);
+    ref_ul_len = run_uplink(ul_in, ul_frames, ul_ref, 1, &elapsed);
+
+    for (k = 0; k < nkernels; k++) {
+        size_t len;
+
+        if (check_dot(&kernels[k]))
+            failed = 1;
+
+        fir_dot_s16 = kernels[k].fn;
+
+        len = run_downlink(dl_in, dl_frames, dl_out, 0, &elapsed);
+        if (len != ref_dl_len || memcmp(dl_out, dl_ref, len * sizeof(int16_t))) {
+            printf("FAIL %s downlink differs from scalar\n", kernels[k].name);
+            failed = 1;
+        }
+        run_downlink(dl_in, dl_frames, dl_out, 1, &elapsed);
+        report("downlink", kernels[k].name, elapsed, dl_frames);
+
+        len = run_uplink(ul_in, ul_frames, ul_out, 0, &elapsed);
+        if (len != ref_ul_len || memcmp(ul_out, ul_ref, 2 * len * sizeof(int16_t))) {
+            printf("FAIL %s uplink differs from scalar\n", kernels[k].name);
+            failed = 1;
+        }
+        run_uplink(ul_in, ul_frames, ul_out, 1, &elapsed);
+        report("uplink", kernels[k].name, elapsed, ul_frames * SCO_RESAMPLE_RATIO);
+    }
+
+    free(dl_in);
+    free(dl_ref);
+    free(dl_out);
+    free(ul_in);
+    free(ul_ref);
+    free(ul_out);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed;
+}
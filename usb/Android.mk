@@ -19,7 +19,10 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
-	audio_hal.c
+	audio_hal.c \
+	../common/pcm_dump.c \
+	../common/stream_pacer.c \
+	../common/card_registry.c
 
 LOCAL_SHARED_LIBRARIES := \
 	liblog \
@@ -31,6 +34,7 @@ LOCAL_SHARED_LIBRARIES := \
 	libdl
 
 LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/../common \
 	external/tinyalsa/include \
 	$(call include-path-for, audio-utils) \
 	$(call include-path-for, audio-route) \
@@ -23,6 +23,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <log/log.h>
@@ -43,6 +44,10 @@
 #include "alsa_logging.h"
 #include <audio_route/audio_route.h>
 
+#include "pcm_dump.h"
+#include "stream_pacer.h"
+#include "card_registry.h"
+
 //[ BT-HFP
 #include <audio_utils/channels.h>
 #include <audio_utils/resampler.h>
@@ -50,7 +55,6 @@
 #define AUDIO_PARAMETER_CARD         "card"
 #define AUDIO_PARAMETER_HFP_ENABLE   "hfp_enable"
 #define AUDIO_BT_DRIVER_NAME         "btaudiosource"
-//#define DEBUG_PCM_DUMP
 //#define DEBUG_DEVICE_INFO
 // BT-HFP ]
 
@@ -93,6 +97,9 @@ struct audio_device {
 
     bool terminate_sco_loopback;
 // BT-HFP ]
+
+    struct pcm_dump *dump; /* runtime taps, see PCM_DUMP_PARAMETER */
+    struct card_registry cards;
     int32_t inputs_open; /* number of input streams currently open. */
 };
 
@@ -135,6 +142,8 @@ struct stream_out {
                                          * they could come from here too if
                                          * there was a previous conversion */
     size_t conversion_buffer_size;      /* in bytes */
+
+    struct stream_pacer pacer;          /* error pacing timeline, under lock */
 };
 
 struct stream_in {
@@ -538,13 +547,17 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer, si
 {
     int ret;
     struct stream_out *out = (struct stream_out *)stream;
+    int64_t deadline_ns;
 
     stream_lock(&out->lock);
 
     if (is_bt_call_active(out->adev) == 1){
         // Wont allow anything to write with normal playback if sco loopback is ON.
         //ALOGD("%s : usb hal out_write called during sco_thread, skip and return.",__func__);
+        deadline_ns = stream_pacer_advance(&out->pacer, bytes / audio_stream_out_frame_size(stream),
+                                           out_get_sample_rate(&stream->common));
         stream_unlock(&out->lock);
+        stream_pacer_sleep_until(deadline_ns);
         return bytes;
     }
     if (out->standby) {
@@ -585,16 +598,17 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer, si
         proxy_write(&out->proxy, write_buff, num_write_buff_bytes);
     }
 
+    stream_pacer_reset(&out->pacer);
     stream_unlock(&out->lock);
 
     return bytes;
 
 err:
+    /* sleep out the dropped buffer without holding the stream */
+    deadline_ns = stream_pacer_advance(&out->pacer, bytes / audio_stream_out_frame_size(stream),
+                                       out_get_sample_rate(&stream->common));
     stream_unlock(&out->lock);
-    if (ret != 0) {
-        usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
-               out_get_sample_rate(&stream->common));
-    }
+    stream_pacer_sleep_until(deadline_ns);
 
     return bytes;
 }
@@ -1355,28 +1369,20 @@ static void get_device_info(struct audio_device* adev, alsa_device_profile* prof
     }
 }
 
-static int get_pcm_card(const char* name)
+static int get_pcm_card(struct audio_device *adev, const char* name)
 {
-    char id_filepath[PATH_MAX] = {0};
-    char number_filepath[PATH_MAX] = {0};
-    ssize_t written;
+    int card = card_registry_find(&adev->cards, name);
 
-    snprintf(id_filepath, sizeof(id_filepath), "/proc/asound/%s", name);
-
-    written = readlink(id_filepath, number_filepath, sizeof(number_filepath));
-    if (written < 0) {
+    if (card < 0) {
         ALOGE("Sound card %s does not exist - setting default", name);
-            return 0;
-    } else if (written >= (ssize_t)sizeof(id_filepath)) {
-        ALOGE("Sound card %s name is too long - setting default", name);
         return 0;
     }
 
-    return atoi(number_filepath + 4);
+    return card;
 }
 
 void update_bt_card(struct audio_device *adev){
-    adev->btcard = get_pcm_card(AUDIO_BT_DRIVER_NAME); //update driver name if changed by BT Team.
+    adev->btcard = get_pcm_card(adev, AUDIO_BT_DRIVER_NAME); //update driver name if changed by BT Team.
 }
 
 void stop_existing_output_input(struct audio_device *adev){
@@ -1545,15 +1551,15 @@ int looper(struct audio_device *adev, struct pcm_config *in_config, struct pcm_c
     size_t buf_size_out;
     size_t buf_size_remapped;
 
-#ifdef DEBUG_PCM_DUMP
-    char dump_path[PATH_MAX] = {0};
-    snprintf(dump_path, sizeof(dump_path), "/vendor/dump/loopback_read_%s.pcm", id);
-    FILE *loopback_read = fopen(dump_path, "a");
-    snprintf(dump_path, sizeof(dump_path), "/vendor/dump/loopback_remapped_%s.pcm", id);
-    FILE *loopback_remapped = fopen(dump_path, "a");
-    snprintf(dump_path, sizeof(dump_path), "/vendor/dump/loopback_write_%s.pcm", id);
-    FILE *loopback_write = fopen(dump_path, "a");
-#endif
+    char tap_name[PCM_DUMP_NAME_MAX];
+    struct pcm_dump_tap *loopback_read, *loopback_remapped, *loopback_write;
+
+    snprintf(tap_name, sizeof(tap_name), "loopback_read_%s", id);
+    loopback_read = pcm_dump_tap_get(adev->dump, tap_name);
+    snprintf(tap_name, sizeof(tap_name), "loopback_remapped_%s", id);
+    loopback_remapped = pcm_dump_tap_get(adev->dump, tap_name);
+    snprintf(tap_name, sizeof(tap_name), "loopback_write_%s", id);
+    loopback_write = pcm_dump_tap_get(adev->dump, tap_name);
 
     ALOGV("%s : Input rate : %d Output rate : %d id : %s", __func__, in_config->rate, out_config->rate,id);
 
@@ -1604,11 +1610,8 @@ int looper(struct audio_device *adev, struct pcm_config *in_config, struct pcm_c
                 ALOGV("%s : read %zu from bt_in",__func__, buf_size_in);
             }
 
-#ifdef DEBUG_PCM_DUMP
-            if(loopback_read != NULL) {
-                fwrite(buf_in, 1, buf_size_in, loopback_read);
-            }
-#endif
+            pcm_dump_write(loopback_read, buf_in, buf_size_in,
+                    in_config->rate, in_config->channels);
 
             if(need_remapper) {
                 adjusted_bytes = adjust_channels(buf_in, in_config->channels, buf_remapped, out_config->channels, 
@@ -1620,11 +1623,8 @@ int looper(struct audio_device *adev, struct pcm_config *in_config, struct pcm_c
                 memcpy(buf_remapped, buf_in, buf_size_remapped);
             }
 
-#ifdef DEBUG_PCM_DUMP
-            if(loopback_remapped != NULL) {
-                fwrite(buf_remapped, 1, buf_size_remapped, loopback_remapped);
-            }
-#endif
+            pcm_dump_write(loopback_remapped, buf_remapped, buf_size_remapped,
+                    in_config->rate, out_config->channels);
 
             //Check if resampling is required.
             if(resampler != NULL) {
@@ -1635,11 +1635,8 @@ int looper(struct audio_device *adev, struct pcm_config *in_config, struct pcm_c
                 memcpy(buf_out, buf_remapped, buf_size_out);
             }
 
-#ifdef DEBUG_PCM_DUMP
-            if(loopback_write != NULL) {
-                fwrite(buf_out, 1, buf_size_out, loopback_write);
-            }
-#endif
+            pcm_dump_write(loopback_write, buf_out, buf_size_out,
+                    out_config->rate, out_config->channels);
 
             write_err = proxy_write(out_proxy, buf_out, buf_size_out);
 
@@ -1675,15 +1672,6 @@ int looper(struct audio_device *adev, struct pcm_config *in_config, struct pcm_c
         }
     }
 
-#ifdef DEBUG_PCM_DUMP
-    if(loopback_read != NULL)
-        fclose(loopback_read);
-    if(loopback_remapped != NULL)
-        fclose(loopback_remapped);
-    if(loopback_write != NULL)
-        fclose(loopback_write);
-#endif
-
 
     release_resampler(resampler);
     free(buf_out);
@@ -1734,6 +1722,7 @@ static int adev_set_parameters(struct audio_hw_device *hw_dev, const char *kvpai
 
     struct audio_device * adev = (struct audio_device *)hw_dev;
     char value[32];
+    char dump_taps[PCM_DUMP_MAX_TAPS * PCM_DUMP_NAME_MAX];
     int ret, val = 0;
     struct str_parms *parms;
 
@@ -1778,6 +1767,10 @@ static int adev_set_parameters(struct audio_hw_device *hw_dev, const char *kvpai
         pthread_mutex_unlock(&adev->param_thread_lock);
     }
 
+    ret = str_parms_get_str(parms, PCM_DUMP_PARAMETER, dump_taps, sizeof(dump_taps));
+    if (ret >= 0)
+        pcm_dump_set_taps(adev->dump, dump_taps);
+
     str_parms_destroy(parms);
 
     return 0;
@@ -1871,6 +1864,10 @@ static int adev_dump(const struct audio_hw_device *device, int fd)
 
 static int adev_close(hw_device_t *device)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+
+    pcm_dump_destroy(adev->dump);
+    card_registry_release(&adev->cards);
     free(device);
 
     return 0;
@@ -1912,6 +1909,9 @@ static int adev_open(const hw_module_t* module, const char* name, hw_device_t**
     adev->hw_device.close_input_stream = adev_close_input_stream;
     adev->hw_device.dump = adev_dump;
 
+    adev->dump = pcm_dump_create(PCM_DUMP_DIR_DEFAULT, "usb");
+    card_registry_init(&adev->cards);
+
     *device = &adev->hw_device.common;
 
     return 0;